@@ -1,4 +1,216 @@
 #include <bits/stdc++.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Instrumentation, compiled in with -DPROFILE=1. PROFILE_SCOPE(name) times
+// the rest of the enclosing block, PROFILE_COUNT(name, value) records a
+// value such as a node count; every point keeps calls, total, max and a
+// log2 histogram, aggregated over the process and printed by
+// profile_report() at game end. A thread that plays one of several
+// concurrent games (a serve() session) also records into that game's
+// ProfileGame while a ProfileGameScope is open; WorkerPool jobs and
+// speculation threads inherit the scope of the thread that started them.
+// With PROFILE=0 the macros are empty and ProfileGame holds nothing.
+#ifndef PROFILE
+#define PROFILE 0
+#endif
+
+#if PROFILE
+struct ProfileStats {
+        std::atomic<unsigned long long> calls{0};
+        std::atomic<unsigned long long> total{0};
+        std::atomic<unsigned long long> max{0};
+        std::array<std::atomic<unsigned long long>, 64> hist{};
+
+        void add(unsigned long long value)
+        {
+                calls.fetch_add(1, std::memory_order_relaxed);
+                total.fetch_add(value, std::memory_order_relaxed);
+                auto seen = max.load(std::memory_order_relaxed);
+                while (value > seen && !max.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+                }
+                hist[value ? 64 - __builtin_clzll(value) - 1 : 0].fetch_add(1, std::memory_order_relaxed);
+        }
+};
+
+// One game's share of every point, indexed by ProfilePoint::id.
+struct ProfileGame {
+        static constexpr std::size_t max_points = 256;
+
+        std::array<ProfileStats, max_points> stats;
+};
+
+// The game the current thread records into besides the process totals.
+thread_local ProfileGame *profile_game = nullptr;
+
+struct ProfilePoint {
+        const char *name;
+        const char *unit;
+        std::size_t id;
+        ProfileStats stats;
+
+        ProfilePoint(const char *_name, const char *_unit) : name(_name), unit(_unit)
+        {
+                std::lock_guard<std::mutex> g(lock());
+                id = points().size();
+                points().push_back(this);
+        }
+
+        static std::mutex &lock()
+        {
+                static std::mutex res;
+                return res;
+        }
+
+        static std::vector<ProfilePoint *> &points()
+        {
+                static std::vector<ProfilePoint *> res;
+                return res;
+        }
+
+        void add(unsigned long long value)
+        {
+                stats.add(value);
+                if (profile_game && id < ProfileGame::max_points) {
+                        profile_game->stats[id].add(value);
+                }
+        }
+};
+
+struct ProfileTimer {
+        ProfilePoint &point;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        ~ProfileTimer()
+        {
+                point.add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        }
+};
+
+// Makes the current thread record into game until the scope closes.
+struct ProfileGameScope {
+        ProfileGame *saved = profile_game;
+
+        explicit ProfileGameScope(ProfileGame *game)
+        {
+                profile_game = game;
+        }
+
+        ~ProfileGameScope()
+        {
+                profile_game = saved;
+        }
+};
+
+ProfileGame *profile_current()
+{
+        return profile_game;
+}
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(name)                                                                 \
+        static ProfilePoint PROFILE_CONCAT(profile_point_, __LINE__)(name, "ns");          \
+        ProfileTimer PROFILE_CONCAT(profile_timer_, __LINE__){PROFILE_CONCAT(profile_point_, __LINE__)}
+#define PROFILE_COUNT(name, value)                        \
+        do {                                              \
+                static ProfilePoint profile_point(name, ""); \
+                profile_point.add(value);                 \
+        } while (0)
+#else
+#define PROFILE_SCOPE(name) ((void) 0)
+#define PROFILE_COUNT(name, value) ((void) 0)
+
+struct ProfileGame {
+};
+
+struct ProfileGameScope {
+        explicit ProfileGameScope(ProfileGame *)
+        {
+        }
+};
+
+ProfileGame *profile_current()
+{
+        return nullptr;
+}
+#endif
+
+// Prints the aggregates of every instrumentation point on stderr, or as
+// JSON to json_path if it is not empty: the process totals, or only what
+// `game` recorded if it is given. Points of different template
+// instantiations with the same name are merged.
+void profile_report([[maybe_unused]] const std::string &json_path, [[maybe_unused]] const ProfileGame *game = nullptr)
+{
+#if PROFILE
+        struct Total {
+                std::string unit;
+                unsigned long long calls = 0, total = 0, max = 0;
+                std::array<unsigned long long, 64> hist{};
+        };
+        std::map<std::string, Total> totals;
+        std::unique_lock<std::mutex> g(ProfilePoint::lock());
+        for (const auto *p : ProfilePoint::points()) {
+                if (game && p->id >= ProfileGame::max_points) {
+                        continue;
+                }
+                const auto &s = game ? game->stats[p->id] : p->stats;
+                if (game && !s.calls) {
+                        continue;
+                }
+                auto &t = totals[p->name];
+                t.unit = p->unit;
+                t.calls += s.calls;
+                t.total += s.total;
+                t.max = std::max<unsigned long long>(t.max, s.max);
+                for (std::size_t b = 0; b < t.hist.size(); ++b) {
+                        t.hist[b] += s.hist[b];
+                }
+        }
+        g.unlock();
+
+        if (!json_path.empty()) {
+                std::ofstream out(json_path);
+                out << "{\"points\": [";
+                bool first = true;
+                for (const auto &[name, t] : totals) {
+                        out << (first ? "" : ",") << "\n  {\"name\": \"" << name << "\", \"unit\": \"" << t.unit
+                            << "\", \"calls\": " << t.calls << ", \"total\": " << t.total << ", \"max\": " << t.max
+                            << ", \"log2_hist\": [";
+                        std::size_t last = t.hist.size();
+                        while (last > 0 && !t.hist[last - 1]) {
+                                --last;
+                        }
+                        for (std::size_t b = 0; b < last; ++b) {
+                                out << (b ? ", " : "") << t.hist[b];
+                        }
+                        out << "]}";
+                        first = false;
+                }
+                out << "\n]}\n";
+                return;
+        }
+
+        std::cerr << "profile:\n";
+        for (const auto &[name, t] : totals) {
+                std::cerr << "  " << std::left << std::setw(24) << name << std::right << " calls " << t.calls
+                          << " mean " << (t.calls ? t.total / t.calls : 0) << t.unit
+                          << " max " << t.max << t.unit << " log2 hist";
+                for (std::size_t b = 0; b < t.hist.size(); ++b) {
+                        if (t.hist[b]) {
+                                std::cerr << " " << b << ":" << t.hist[b];
+                        }
+                }
+                std::cerr << "\n";
+        }
+#endif
+}
 
 struct PlayerInfo {
         unsigned army;
@@ -27,14 +239,6 @@ using Cell    = std::variant<Hidden, Visible>;
 
 using CellI = std::pair<unsigned, unsigned>;
 
-template <> struct std::hash<CellI> {
-        std::size_t operator()(CellI const &x) const noexcept
-        {
-                return std::hash<unsigned>{}(x.first) ^
-                    (std::hash<unsigned>{}(x.second) << 1);
-        };
-};
-
 struct Skip {
 };
 
@@ -48,6 +252,59 @@ struct Move {
 
 using Turn = std::variant<Skip, Move>;
 
+bool operator==(const Skip &, const Skip &)
+{
+        return true;
+}
+
+bool operator==(const Move &a, const Move &b)
+{
+        return a.type == b.type && a.src == b.src && a.dest == b.dest;
+}
+
+// Heap allocation counting for --replay, compiled in with
+// -DCOUNT_ALLOCS=1: a replaced global operator new counts every
+// allocation. With COUNT_ALLOCS=0 the bot keeps the library's operator
+// new and allocation_count() is always 0.
+#ifndef COUNT_ALLOCS
+#define COUNT_ALLOCS 0
+#endif
+
+#if COUNT_ALLOCS
+std::atomic<unsigned long long> allocations{0};
+
+void *operator new(std::size_t n)
+{
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        if (void *p = std::malloc(n ? n : 1)) {
+                return p;
+        }
+        throw std::bad_alloc();
+}
+
+// Out of line: GCC pairs an inlined free() with the allocation site and
+// warns about a new/free mismatch.
+[[gnu::noinline]] void operator delete(void *p) noexcept
+{
+        std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, std::size_t) noexcept
+{
+        std::free(p);
+}
+#endif
+
+// Heap allocations made so far.
+unsigned long long allocation_count()
+{
+#if COUNT_ALLOCS
+        return allocations.load(std::memory_order_relaxed);
+#else
+        return 0;
+#endif
+}
+
 std::istream &operator>>(std::istream &in, PlayerInfo &x)
 {
         return (in >> x.army >> x.land);
@@ -112,576 +369,4692 @@ std::istream &operator>>(std::istream &in, Cell &c)
         return in;
 }
 
-std::ostream &operator<<(std::ostream &out, const Skip &)
-{
-        return (out << -1);
-}
-
-std::ostream &operator<<(std::ostream &out, const CellI &x)
-{
-        return (out << (x.second + 1) << " " << (x.first + 1));
-}
+// Longest answer line format_turn() writes: type and four coordinates.
+constexpr std::size_t max_turn_text = 2 + 4 * 11;
 
-std::ostream &operator<<(std::ostream &out, const Move &x)
+char *format_uint(char *p, unsigned v)
 {
-        return (out << (int)x.type << " " << x.src << " " << x.dest);
+        char digits[10];
+        unsigned n = 0;
+        do {
+                digits[n++] = '0' + v % 10;
+                v /= 10;
+        } while (v);
+        while (n) {
+                *p++ = digits[--n];
+        }
+        return p;
 }
 
-std::ostream &operator<<(std::ostream &out, const Turn &x)
+// Writes the answer line for x, newline included, to buf (max_turn_text
+// chars) and returns its length.
+std::size_t format_turn(const Turn &x, char *buf)
 {
+        char *p = buf;
         if (std::holds_alternative<Skip>(x)) {
-                out << std::get<Skip>(x) << std::endl;
-        } else if (std::holds_alternative<Move>(x)) {
-                out << std::get<Move>(x) << std::endl;
+                *p++ = '-';
+                *p++ = '1';
+        } else if (const auto *move = std::get_if<Move>(&x)) {
+                p = format_uint(p, (unsigned) move->type);
+                for (const CellI *c : {&move->src, &move->dest}) {
+                        *p++ = ' ';
+                        p = format_uint(p, c->second + 1);
+                        *p++ = ' ';
+                        p = format_uint(p, c->first + 1);
+                }
         } else {
                 throw std::invalid_argument("Invalid turn");
         }
-        return out;
+        *p++ = '\n';
+        return p - buf;
 }
 
-std::optional<Armed> get_armed(const Cell &c) {
-        if (!std::holds_alternative<Visible>(c)) {
-                return std::nullopt;
-        }
-        const auto &v = std::get<Visible>(c);
-        if (!std::holds_alternative<Armed>(v)) {
-                return std::nullopt;
-        }
-        return std::get<Armed>(v);
-}
+// Sends answers to fd. put() formats a turn on the stack and writes it
+// with a single write(); with `batch` it only appends to buf, and flush()
+// writes everything gathered so far at once.
+struct TurnWriter {
+        int fd;
+        bool batch = false;
+        std::vector<char> buf;
 
-bool can_pass(const Cell &c) {
-        if (std::holds_alternative<Hidden>(c)) {
-                return std::get<Hidden>(c) == Hidden::Empty;
-        } else if (std::holds_alternative<Visible>(c)) {
-                return std::holds_alternative<Armed>(std::get<Visible>(c));
-        } else {
-                return false;
+        explicit TurnWriter(int _fd, bool _batch = false) : fd(_fd), batch(_batch)
+        {
+                if (batch) {
+                        buf.reserve(1 << 12);
+                }
         }
-}
-
-struct Field {
-        unsigned size_x;
-        unsigned size_y;
 
-        std::vector<std::vector<Cell>> table;
+        bool put(const Turn &turn)
+        {
+                char text[max_turn_text];
+                std::size_t len = format_turn(turn, text);
+                if (batch) {
+                        buf.insert(buf.end(), text, text + len);
+                        return true;
+                }
+                return send(text, len);
+        }
 
-        Field(unsigned x, unsigned y) : size_x(x), size_y(y)
+        bool flush()
         {
-                table.resize(x, std::vector<Cell>(y));
+                bool ok = send(buf.data(), buf.size());
+                buf.clear();
+                return ok;
         }
 
-        void read_table(std::istream &in)
+      private:
+        bool send(const char *data, std::size_t len)
         {
-                for (unsigned y = 0; y < size_y; ++y) {
-                        for (unsigned x = 0; x < size_x; ++x) {
-                                in >> table[x][y];
+                for (std::size_t done = 0; done < len;) {
+                        ssize_t put = ::write(fd, data + done, len - done);
+                        if (put < 0 && errno == EINTR) {
+                                continue;
                         }
+                        if (put <= 0) {
+                                return false;
+                        }
+                        done += put;
                 }
+                return true;
         }
+};
 
-        void check(const CellI &pos) const
+// Buffered reader of non-negative integers from a file descriptor. Each
+// refill is a single read() of whatever is available, normally the whole
+// turn block; numbers are parsed by hand. At end of input next() returns 0
+// and sets eof, mirroring a failed std::istream extraction.
+struct FdReader {
+        int fd;
+        std::vector<char> buf;
+        std::size_t pos = 0;
+        std::size_t len = 0;
+        bool eof        = false;
+
+        explicit FdReader(int _fd, std::size_t capacity = 1 << 20) : fd(_fd), buf(capacity)
         {
-                if (pos.first < 0 || pos.first >= size_x) {
-                        throw std::out_of_range("Field pos out of range\n");
-                }
-                if (pos.second < 0 || pos.second >= size_y) {
-                        throw std::out_of_range("Field pos out of range\n");
-                }
         }
 
-        Cell at(const CellI &pos) const
+        // With fd < 0 the reader holds only what feed() appended, and its
+        // input ends where that does.
+        void feed(const char *data, std::size_t n)
         {
-                check(pos);
-                return table[pos.first][pos.second];
+                std::copy(buf.begin() + pos, buf.begin() + len, buf.begin());
+                len -= pos;
+                pos = 0;
+                if (len + n > buf.size()) {
+                        buf.resize(std::max(len + n, 2 * buf.size()));
+                }
+                std::copy(data, data + n, buf.begin() + len);
+                len += n;
+                eof = false;
         }
 
-        Cell &at(const CellI &pos)
+        int get()
         {
-                check(pos);
-                return table[pos.first][pos.second];
-        };
+                if (pos == len) {
+                        if (fd < 0) {
+                                eof = true;
+                                return -1;
+                        }
+                        ssize_t got;
+                        do {
+                                got = ::read(fd, buf.data(), buf.size());
+                        } while (got < 0 && errno == EINTR);
+                        if (got <= 0) {
+                                eof = true;
+                                return -1;
+                        }
+                        pos = 0;
+                        len = got;
+                }
+                return (unsigned char) buf[pos++];
+        }
 
-        std::vector<CellI> neighbors(const CellI &pos) const
+        unsigned next()
         {
-                std::vector<CellI> res;
-                if (pos.first > 0) {
-                        res.push_back({pos.first - 1, pos.second});
+                int c = get();
+                while (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+                        c = get();
                 }
-                if (pos.first + 1 < size_x) {
-                        res.push_back({pos.first + 1, pos.second});
+                if (c < 0) {
+                        return 0;
                 }
-                if (pos.second > 0) {
-                        res.push_back({pos.first, pos.second - 1});
+                if (c < '0' || c > '9') {
+                        throw std::runtime_error("Invalid input character");
                 }
-                if (pos.second + 1 < size_y) {
-                        res.push_back({pos.first, pos.second + 1});
+                unsigned res = 0;
+                for (; c >= '0' && c <= '9'; c = get()) {
+                        res = res * 10 + (c - '0');
                 }
                 return res;
         }
 
-        unsigned dist(const CellI &pos1, const CellI &pos2) const {
-                return std::abs((int) pos1.first - (int) pos2.first) + std::abs((int) pos1.second - (int) pos2.second);
+        template <class T>
+        FdReader &operator>>(T &x)
+        {
+                x = next();
+                return *this;
         }
 };
 
-struct State {
-        unsigned player_count;
-        unsigned player_id;
-
-        Field field;
-        std::vector<PlayerInfo> info;
-
-        unsigned turn_num;
+FdReader &operator>>(FdReader &in, PlayerInfo &x)
+{
+        return (in >> x.army >> x.land);
+}
 
-        std::unordered_map<unsigned, std::pair<CellI, unsigned>> capital;
-        bool exists_not_me = false;
-        std::mt19937 rnd;
+// Replay file: "GBR1", then LEB128 varints: the header n m k id, and per
+// turn a 1, the k player infos, the number of changed cells, each as
+// (index delta, CellKind bits, owner, size), and the answer: 0 for a skip
+// or the move type followed by src x, src y, dest x, dest y. A 0 instead
+// of the turn's 1 ends the game.
+struct ReplayWriter {
+        std::ofstream out;
+        std::string buf;
 
-        State(unsigned x, unsigned y, unsigned _count, unsigned _id)
-            : player_count(_count), player_id(_id), field(x, y),
-              info(_count + 1), turn_num(0)
+        explicit ReplayWriter(const std::string &path) : out(path, std::ios::binary)
         {
-                rnd.seed(57444179);
-                if (player_id > player_count) {
-                        throw std::runtime_error("Invalid player id");
+                if (!out) {
+                        throw std::runtime_error("Cannot open " + path);
                 }
+                buf = "GBR1";
         }
 
-        void update_info()
+        ~ReplayWriter()
         {
-                for (unsigned x = 0; x < field.size_x; ++x) {
-                        for (unsigned y = 0; y < field.size_y; ++y) {
-                                const auto &armed = get_armed(field.at({x, y}));
-                                if (!armed) {
-                                        continue;
-                                }
-                                if (armed->type == ArmyType::Capital) {
-                                        capital[armed->army.owner] = {
-                                            {x, y}, armed->army.size};
-                                }
-                                if (armed && armed->army.owner != player_id && armed->army.owner != 0) {
-                                        exists_not_me = true;
-                                }
-                        }
-                }
+                put(0);
+                flush();
         }
 
-        void read_next(std::istream &in)
+        void put(unsigned x)
         {
-                ++turn_num;
-                for (unsigned i = 1; i <= player_count; ++i) {
-                        in >> info[i];
+                for (; x >= 0x80; x >>= 7) {
+                        buf.push_back((char) (x | 0x80));
                 }
+                buf.push_back((char) x);
+        }
 
-                field.read_table(in);
-                update_info();
+        void header(unsigned n, unsigned m, unsigned k, unsigned id)
+        {
+                put(n);
+                put(m);
+                put(k);
+                put(id);
         }
 
+        // The turn as read_next left it; field.changed is in index order.
+        template <class Grid>
+        void input(const std::vector<PlayerInfo> &info, const Grid &field)
+        {
+                put(1);
+                for (std::size_t p = 1; p < info.size(); ++p) {
+                        put(info[p].army);
+                        put(info[p].land);
+                }
+                put(field.changed.size());
+                unsigned prev = 0;
+                for (unsigned i : field.changed) {
+                        put(i - prev);
+                        put(field.kind[i]);
+                        put(field.owner[i]);
+                        put(field.size[i]);
+                        prev = i;
+                }
+        }
 
-        std::optional<int> capture_cost(const CellI &pos) const {
-                const auto &c = field.at(pos);
-                if (std::holds_alternative<Visible>(c)) {
-                        const auto &V = std::get<Visible>(c);
-                        if (std::holds_alternative<Armed>(V)) {
-                                const auto &A = std::get<Armed>(V);
-                                if (A.army.owner == player_id) {
-                                        return 1 - A.army.size;
-                                } else {
-                                        return A.army.size + 1;
-                                }
-                        } else {
-                                return std::nullopt;
-                        }
+        // Written per turn so that a crash keeps everything before it.
+        void answer(const Turn &turn)
+        {
+                if (const auto *move = std::get_if<Move>(&turn)) {
+                        put((unsigned) move->type);
+                        put(move->src.first);
+                        put(move->src.second);
+                        put(move->dest.first);
+                        put(move->dest.second);
                 } else {
-                        const auto &H = std::get<Hidden>(c);
-                        if (H == Hidden::Obstacle) {
-                                return std::nullopt;
-                        } else if (H == Hidden::Empty) {
-                                return 1;
-                        }
+                        put(0);
                 }
-                return std::nullopt;
+                flush();
         }
 
-        struct PathGeneratorState {
-                std::mt19937 rnd;
-                std::deque<CellI> cur;
-                std::unordered_set<CellI> used;
-                unsigned units;
-                unsigned iterations = 0;
-                unsigned depth;
-        };
+        void flush()
+        {
+                out.write(buf.data(), buf.size());
+                out.flush();
+                buf.clear();
+        }
+};
+
+// Reads a whole replay file into memory; read_next consumes it through
+// operator>> and Field::read_table like any other input.
+struct ReplayReader {
+        std::vector<unsigned char> data;
+        std::size_t pos = 4;
+        bool eof        = false;
 
-        template <class ExitCondition, class ComparePaths>
-        std::deque<CellI> gen_path(PathGeneratorState &state, ExitCondition &exit, ComparePaths &comp) const
+        explicit ReplayReader(const std::string &path)
         {
-                ++state.iterations;
-                std::deque<CellI> res = state.cur;
-                if (state.units == 0 || exit(state)) {
-                        return res;
+                std::ifstream in(path, std::ios::binary);
+                data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+                if (data.size() < 4 || std::string(data.begin(), data.begin() + 4) != "GBR1") {
+                        throw std::runtime_error("Not a replay file: " + path);
                 }
+        }
 
-                state.used.insert(state.cur.back());
-                auto neighbors = field.neighbors(state.cur.back());
-                std::shuffle(neighbors.begin(), neighbors.end(), state.rnd);
-                for (const auto &cand : neighbors) {
-                        auto c = capture_cost(cand);
-                        if (c && state.units > (unsigned) std::max(0, *c) && state.used.find(cand) == state.used.end()) {
-                                state.cur.push_back(cand);
-                                state.units -= *c;
-                                ++state.depth;
-                                auto next_res = gen_path(state, exit, comp);
-                                if (comp(next_res, res)) {
-                                        res = std::move(next_res);
-                                }
-                                --state.depth;
-                                state.units += *c;
-                                state.cur.pop_back();
+        unsigned next()
+        {
+                unsigned res = 0;
+                for (unsigned shift = 0;; shift += 7) {
+                        if (pos == data.size()) {
+                                eof = true;
+                                return 0;
+                        }
+                        unsigned char c = data[pos++];
+                        res |= (unsigned) (c & 0x7f) << shift;
+                        if (!(c & 0x80)) {
+                                return res;
                         }
                 }
-                state.used.erase(state.cur.back());
-                return res;
         }
 
-        unsigned my_units(const CellI &pos) const {
-                const auto &c = field.at(pos);
-                if (!std::holds_alternative<Visible>(c)) {
-                        return 0;
-                }
-                const auto &v = std::get<Visible>(c);
-                if (!std::holds_alternative<Armed>(v)) {
-                        return 0;
-                }
-                const auto &a = std::get<Armed>(v);
-                if (a.army.owner == player_id) {
-                        return a.army.size;
-                } else {
-                        return 0;
-                }
+        template <class T>
+        ReplayReader &operator>>(T &x)
+        {
+                x = next();
+                return *this;
         }
 
-        std::vector<CellI> my_cells() const {
-                std::vector<CellI> res;
-                for (unsigned x = 0; x < field.size_x; ++x) {
-                        for (unsigned y = 0; y < field.size_y; ++y) {
-                                unsigned units = my_units({x, y});
-                                if (units > 0) {
-                                        res.push_back({x, y});
-                                }
-                        }
+        template <class Grid>
+        void read_cells(Grid &field)
+        {
+                unsigned count = next();
+                unsigned i     = 0;
+                for (unsigned c = 0; c < count; ++c) {
+                        i += next();
+                        uint8_t kind   = next();
+                        unsigned owner = next();
+                        unsigned size  = next();
+                        field.store(i, kind, owner, size);
                 }
-                return res;
         }
 
-        struct PathCaptureMetric {
-                unsigned size;
-                unsigned dist_sum;
-
-                bool operator<(const PathCaptureMetric &other) const {
-                        return size > other.size || (size == other.size && dist_sum < other.dist_sum);
+        Turn turn()
+        {
+                unsigned type = next();
+                if (!type) {
+                        return Skip{};
                 }
-        };
+                Move move{(MoveType) type, {}, {}};
+                move.src.first   = next();
+                move.src.second  = next();
+                move.dest.first  = next();
+                move.dest.second = next();
+                return move;
+        }
+};
 
-        PathCaptureMetric path_capture_metric(const std::deque<CellI> &x) const {
-                auto dist = [&](const CellI &pos) -> unsigned {
-                        return field.dist(pos, capital.find(player_id)->second.first);
-                };
+ReplayReader &operator>>(ReplayReader &in, PlayerInfo &x)
+{
+        return (in >> x.army >> x.land);
+}
 
-                auto filter = [&](const CellI &pos) -> bool {
-                        const auto &c = field.at(pos);
-                        if (std::holds_alternative<Hidden>(c)) {
-                                return true;
-                        }
-                        if (std::holds_alternative<Visible>(c)) {
-                                const auto &v = std::get<Visible>(c);
-                                return (std::holds_alternative<Armed>(v) &&
-                                        std::get<Armed>(v).army.owner !=
-                                            player_id);
-                        }
-                        return false;
-                };
+// The up to four orthogonal neighbours of a cell, held inline.
+struct Neighbors {
+        std::array<unsigned, 4> cell;
+        unsigned count = 0;
 
-                unsigned size_x = 0;
-                unsigned sum_dist = 0;
+        void push_back(unsigned i)
+        {
+                cell[count++] = i;
+        }
 
-                for (const auto &tmp : x) {
-                        size_x += filter(tmp);
-                        sum_dist += dist(tmp);
-                }
+        unsigned *begin()
+        {
+                return cell.data();
+        }
 
-                return {size_x, sum_dist};
+        unsigned *end()
+        {
+                return cell.data() + count;
         }
 
-        std::deque<CellI> greedy_path;
+        const unsigned *begin() const
+        {
+                return cell.data();
+        }
 
-        Turn greedy_start()
+        const unsigned *end() const
         {
-                if (greedy_path.size() < 2 && (turn_num < 400 && capital[player_id].second <= 10)) {
-                        return Skip{};
-                } else {
-                        auto cmp_res = [&](const std::deque<CellI> &x, const std::deque<CellI> &y) -> bool {
-                                return path_capture_metric(x) < path_capture_metric(y);
-                        };
-                        auto exit_condition = [](const PathGeneratorState &s) -> bool {
-                                return s.depth >= 10 || s.iterations > 1000;
-                        };
+                return cell.data() + count;
+        }
+};
 
-                        CellI begin;
-                        std::deque<CellI> prev_path;
-                        if (greedy_path.empty() || my_units(greedy_path.front()) <= 1) {
-                                if (turn_num >= 400) {
-                                        std::vector<CellI> cells = my_cells();
-                                        begin = cells[rnd() % (unsigned) cells.size()];
-                                } else {
-                                        begin = capital[player_id].first;
+// Board dimensions as compile-time constants, so that the neighbour
+// arithmetic and edge tests of the search loops fold into immediates.
+// Shape<> is the fallback for other sizes and keeps them at run time.
+template <unsigned W = 0, unsigned H = 0>
+struct Shape {
+        unsigned x = W;
+        unsigned y = H;
+
+        Shape(unsigned _x, unsigned _y)
+        {
+                if constexpr (W == 0) {
+                        x = _x;
+                        y = _y;
+                }
+        }
+
+        unsigned size_x() const
+        {
+                if constexpr (W != 0) {
+                        return W;
+                }
+                return x;
+        }
+
+        unsigned cells() const
+        {
+                if constexpr (W != 0) {
+                        return W * H;
+                }
+                return x * y;
+        }
+
+        // Index of cell i in a (size_x + 2) * (size_y + 2) grid that
+        // surrounds the board with a border.
+        unsigned padded(unsigned i) const
+        {
+                return i + 2 * (i / size_x()) + size_x() + 3;
+        }
+
+        Neighbors neighbors(unsigned i) const
+        {
+                Neighbors res;
+                unsigned col = i % size_x();
+                if (col > 0) {
+                        res.push_back(i - 1);
+                }
+                if (col + 1 < size_x()) {
+                        res.push_back(i + 1);
+                }
+                if (i >= size_x()) {
+                        res.push_back(i - size_x());
+                }
+                if (i + size_x() < cells()) {
+                        res.push_back(i + size_x());
+                }
+                return res;
+        }
+};
+
+// Calls f with the Shape instantiation for an x by y board: the square
+// sizes the judge uses get their own, everything else Shape<>.
+template <class F>
+decltype(auto) with_shape(unsigned x, unsigned y, F &&f)
+{
+#define FIXED_SHAPE(n)                                \
+        if (x == n && y == n) {                       \
+                return f(Shape<n, n>(x, y));          \
+        }
+        FIXED_SHAPE(10)
+        FIXED_SHAPE(15)
+        FIXED_SHAPE(20)
+        FIXED_SHAPE(25)
+        FIXED_SHAPE(30)
+        FIXED_SHAPE(40)
+        FIXED_SHAPE(50)
+#undef FIXED_SHAPE
+        return f(Shape<>(x, y));
+}
+
+// One bit per cell, rows packed into 64-bit words, each row starting on a
+// word boundary; bits past size_x are always 0. Neighbour sets are word
+// shifts: a BFS layer costs a few instructions per 64 cells.
+struct BitBoard {
+        unsigned size_x = 0;
+        unsigned size_y = 0;
+        unsigned row    = 0;
+        std::vector<uint64_t> words;
+
+        BitBoard() = default;
+
+        BitBoard(unsigned x, unsigned y) : size_x(x), size_y(y), row((x + 63) / 64), words(row * y)
+        {
+        }
+
+        std::size_t word(unsigned i) const
+        {
+                return (std::size_t) (i / size_x) * row + i % size_x / 64;
+        }
+
+        bool test(unsigned i) const
+        {
+                return words[word(i)] >> (i % size_x % 64) & 1;
+        }
+
+        void assign(unsigned i, bool on)
+        {
+                uint64_t bit = uint64_t(1) << (i % size_x % 64);
+                words[word(i)] = on ? words[word(i)] | bit : words[word(i)] & ~bit;
+        }
+
+        void clear()
+        {
+                std::fill(words.begin(), words.end(), 0);
+        }
+
+        unsigned count() const
+        {
+                unsigned res = 0;
+                for (uint64_t w : words) {
+                        res += __builtin_popcountll(w);
+                }
+                return res;
+        }
+
+        // this = (from and its neighbours) & mask & ~except, on rows lo
+        // to hi only. mask keeps the bits past size_x clear, so shifts
+        // need no edge masks.
+        void spread(const BitBoard &from, const BitBoard &mask, const BitBoard *except = nullptr, unsigned lo = 0,
+                    unsigned hi = std::numeric_limits<unsigned>::max())
+        {
+                const uint64_t *f = from.words.data();
+                for (unsigned y = lo; y <= std::min(hi, size_y - 1); ++y) {
+                        for (unsigned k = 0; k < row; ++k) {
+                                const std::size_t j = y * row + k;
+                                uint64_t w = f[j];
+                                uint64_t n = w | w << 1 | w >> 1;
+                                if (k > 0) {
+                                        n |= f[j - 1] >> 63;
+                                }
+                                if (k + 1 < row) {
+                                        n |= f[j + 1] << 63;
+                                }
+                                if (y > 0) {
+                                        n |= f[j - row];
+                                }
+                                if (y + 1 < size_y) {
+                                        n |= f[j + row];
+                                }
+                                words[j] = n & mask.words[j] & (except ? ~except->words[j] : ~uint64_t(0));
+                        }
+                }
+        }
+
+        // Grows the set bits of a row to the whole runs of m they are in:
+        // Kogge-Stone fills towards higher and then lower bits, six
+        // shift steps each, carried across the words of the row.
+        static void fill_row(uint64_t *s, const uint64_t *m, unsigned row)
+        {
+                for (unsigned k = 0; k < row; ++k) {
+                        uint64_t gen = s[k] | (k > 0 ? s[k - 1] >> 63 & m[k] : 0), pro = m[k];
+                        for (unsigned shift = 1; shift < 64; shift *= 2) {
+                                gen |= pro & gen << shift;
+                                pro &= pro << shift;
+                        }
+                        s[k] = gen;
+                }
+                for (unsigned k = row; k-- > 0;) {
+                        uint64_t gen = s[k] | (k + 1 < row ? (s[k + 1] & 1) << 63 & m[k] : 0), pro = m[k];
+                        for (unsigned shift = 1; shift < 64; shift *= 2) {
+                                gen |= pro & gen >> shift;
+                                pro &= pro >> shift;
+                        }
+                        s[k] = gen;
+                }
+        }
+
+        // Grows this, a subset of mask, to everything reachable from it
+        // through mask: sweeps down and up the rows, each row taking what
+        // its neighbour row reached and filling its runs, until a pair of
+        // sweeps adds nothing. Open boards settle in a few sweeps.
+        void flood(const BitBoard &mask)
+        {
+                const uint64_t *m = mask.words.data();
+                uint64_t *s = words.data();
+                for (unsigned y = 0; y < size_y; ++y) {
+                        fill_row(s + y * row, m + y * row, row);
+                }
+                for (bool grew = true; grew;) {
+                        grew = false;
+                        auto sweep = [&](unsigned y, unsigned from) {
+                                uint64_t *r = s + y * row;
+                                bool more = false;
+                                for (unsigned k = 0; k < row; ++k) {
+                                        more |= (s[from * row + k] & m[y * row + k] & ~r[k]) != 0;
+                                }
+                                if (more) {
+                                        for (unsigned k = 0; k < row; ++k) {
+                                                r[k] |= s[from * row + k] & m[y * row + k];
+                                        }
+                                        fill_row(r, m + y * row, row);
+                                        grew = true;
+                                }
+                        };
+                        for (unsigned y = 1; y < size_y; ++y) {
+                                sweep(y, y - 1);
+                        }
+                        for (unsigned y = size_y - 1; y-- > 0;) {
+                                sweep(y, y + 1);
+                        }
+                }
+        }
+
+        // BFS rings from source through mask: f(i, d) for every cell
+        // reached at distance d > 0, ring by ring, in index order within
+        // a ring. seen, layer and next are scratch boards of the same
+        // shape, kept by the caller. Each ring only touches the rows the
+        // previous one spans, plus one either side.
+        template <class F>
+        static void rings(unsigned source, const BitBoard &mask, BitBoard &seen, BitBoard &layer, BitBoard &next, const F &f)
+        {
+                const unsigned row = mask.row, w = mask.size_x;
+                seen.clear();
+                layer.clear();
+                next.clear();
+                seen.assign(source, true);
+                layer.assign(source, true);
+                unsigned lo = source / w, hi = lo;
+                for (unsigned d = 1;; ++d) {
+                        const unsigned a = lo > 0 ? lo - 1 : 0, b = std::min(hi + 1, mask.size_y - 1);
+                        next.spread(layer, mask, &seen, a, b);
+                        unsigned next_lo = mask.size_y, next_hi = 0;
+                        for (unsigned y = a; y <= b; ++y) {
+                                for (unsigned k = 0; k < row; ++k) {
+                                        uint64_t bits = next.words[y * row + k];
+                                        if (!bits) {
+                                                continue;
+                                        }
+                                        seen.words[y * row + k] |= bits;
+                                        next_lo = std::min(next_lo, y);
+                                        next_hi = y;
+                                        for (; bits; bits &= bits - 1) {
+                                                f(y * w + k * 64 + __builtin_ctzll(bits), d);
+                                        }
+                                }
+                        }
+                        if (next_lo > next_hi) {
+                                return;
+                        }
+                        std::fill(layer.words.begin() + lo * row, layer.words.begin() + (hi + 1) * row, 0);
+                        std::swap(layer.words, next.words);
+                        lo = next_lo;
+                        hi = next_hi;
+                }
+        }
+};
+
+struct CellKind {
+        static constexpr uint8_t Visible = 1;
+        static constexpr uint8_t Blocked = 2;
+        static constexpr uint8_t City    = 4;
+        static constexpr uint8_t Capital = 8;
+};
+
+struct Field {
+        unsigned size_x;
+        unsigned size_y;
+
+        // Struct-of-arrays grid indexed by index(): y * size_x + x.
+        std::vector<unsigned> owner;
+        std::vector<unsigned> size;
+        std::vector<uint8_t> kind;
+
+        // Cells that changed during the last read_table, and the subsets
+        // whose passability flipped.
+        std::vector<unsigned> changed;
+        std::vector<unsigned> blocked;
+        std::vector<unsigned> opened;
+
+        // passable() with a ring of closed sentinels around the board, at
+        // Shape::padded(i): kernels probe all four neighbours without
+        // edge tests.
+        std::vector<uint8_t> open;
+
+        // The cell predicates as bitboards, kept in sync by store(), for
+        // whole-board set operations and flood fills. ours, enemy and
+        // neutral are armed cells as seen by player; ours stays empty
+        // for player 0.
+        unsigned player;
+        struct Masks {
+                BitBoard passable;
+                BitBoard visible;
+                BitBoard city;
+                BitBoard ours;
+                BitBoard enemy;
+                BitBoard neutral;
+        } masks;
+
+        Field(unsigned x, unsigned y, unsigned _player = 0)
+            : size_x(x), size_y(y), owner(x * y), size(x * y), kind(x * y), open((x + 2) * (y + 2)), player(_player),
+              masks{BitBoard(x, y), BitBoard(x, y), BitBoard(x, y), BitBoard(x, y), BitBoard(x, y), BitBoard(x, y)}
+        {
+                changed.reserve(cells());
+                blocked.reserve(cells());
+                opened.reserve(cells());
+                for (unsigned i = 0; i < cells(); ++i) {
+                        open[Shape<>(x, y).padded(i)] = 1;
+                        mark(i);
+                }
+        }
+
+        // Our cells next to passable cells that are not ours: one spread
+        // over the words. outside is scratch.
+        void border(BitBoard &out, BitBoard &outside) const
+        {
+                outside = masks.passable;
+                for (std::size_t j = 0; j < outside.words.size(); ++j) {
+                        outside.words[j] &= ~masks.ours.words[j];
+                }
+                out.spread(outside, masks.ours);
+        }
+
+        unsigned cells() const
+        {
+                return size_x * size_y;
+        }
+
+        void store(unsigned i, uint8_t new_kind, unsigned new_owner, unsigned new_size)
+        {
+                if (kind[i] == new_kind && owner[i] == new_owner && size[i] == new_size) {
+                        return;
+                }
+                changed.push_back(i);
+                bool was_passable = passable(i);
+                kind[i]  = new_kind;
+                owner[i] = new_owner;
+                size[i]  = new_size;
+                mark(i);
+                if (was_passable != passable(i)) {
+                        (was_passable ? blocked : opened).push_back(i);
+                        open[Shape<>(size_x, size_y).padded(i)] = !was_passable;
+                }
+        }
+
+        void mark(unsigned i)
+        {
+                const std::size_t j = masks.passable.word(i);
+                const uint64_t bit  = uint64_t(1) << (i % size_x % 64);
+                auto put = [&](BitBoard &b, bool on) {
+                        b.words[j] = on ? b.words[j] | bit : b.words[j] & ~bit;
+                };
+                const bool is_armed = armed(i);
+                put(masks.passable, passable(i));
+                put(masks.visible, visible(i));
+                put(masks.city, kind[i] & CellKind::City);
+                put(masks.ours, is_armed && player != 0 && owner[i] == player);
+                put(masks.enemy, is_armed && owner[i] != 0 && owner[i] != player);
+                put(masks.neutral, is_armed && owner[i] == 0);
+        }
+
+        void set(unsigned i, const Cell &c)
+        {
+                if (std::holds_alternative<Hidden>(c)) {
+                        store(i, std::get<Hidden>(c) == Hidden::Obstacle ? CellKind::Blocked : 0, 0, 0);
+                        return;
+                }
+                const auto &v = std::get<Visible>(c);
+                if (std::holds_alternative<Mountain>(v)) {
+                        store(i, CellKind::Visible | CellKind::Blocked, 0, 0);
+                        return;
+                }
+                const auto &a = std::get<Armed>(v);
+                uint8_t k = CellKind::Visible;
+                if (a.type == ArmyType::City) {
+                        k |= CellKind::City;
+                } else if (a.type == ArmyType::Capital) {
+                        k |= CellKind::Capital;
+                }
+                store(i, k, a.army.owner, a.army.size);
+        }
+
+        void begin_update()
+        {
+                changed.clear();
+                blocked.clear();
+                opened.clear();
+        }
+
+        void read_table(std::istream &in)
+        {
+                begin_update();
+                Cell c;
+                for (unsigned i = 0; i < cells(); ++i) {
+                        in >> c;
+                        set(i, c);
+                }
+        }
+
+        // Same protocol as operator>>(std::istream &, Cell &), decoded
+        // straight into the arrays.
+        void read_table(FdReader &in)
+        {
+                begin_update();
+                for (unsigned i = 0; i < cells(); ++i) {
+                        unsigned visible = in.next();
+                        unsigned t       = in.next();
+                        if (visible) {
+                                if (t == 4) {
+                                        store(i, CellKind::Visible | CellKind::Blocked, 0, 0);
+                                } else if (t >= 1 && t <= 3) {
+                                        unsigned o = in.next();
+                                        unsigned s = in.next();
+                                        uint8_t k  = CellKind::Visible | (t == 2 ? CellKind::City : t == 3 ? CellKind::Capital : 0);
+                                        store(i, k, o, s);
+                                } else {
+                                        throw std::runtime_error("Invalid type for visible cell");
+                                }
+                        } else if (t == 1 || t == 2) {
+                                store(i, t == 2 ? CellKind::Blocked : 0, 0, 0);
+                        } else {
+                                throw std::runtime_error("Invalid type for hidden cell");
+                        }
+                }
+        }
+
+        void read_table(ReplayReader &in)
+        {
+                begin_update();
+                in.read_cells(*this);
+        }
+
+        void check(const CellI &pos) const
+        {
+                if (pos.first >= size_x || pos.second >= size_y) {
+                        throw std::out_of_range("Field pos out of range\n");
+                }
+        }
+
+        unsigned index(const CellI &pos) const
+        {
+                check(pos);
+                return pos.second * size_x + pos.first;
+        }
+
+        CellI pos(unsigned i) const
+        {
+                return {i % size_x, i / size_x};
+        }
+
+        bool visible(unsigned i) const
+        {
+                return kind[i] & CellKind::Visible;
+        }
+
+        bool passable(unsigned i) const
+        {
+                return !(kind[i] & CellKind::Blocked);
+        }
+
+        // Visible and not a mountain, i.e. owner and size are meaningful.
+        bool armed(unsigned i) const
+        {
+                return (kind[i] & (CellKind::Visible | CellKind::Blocked)) == CellKind::Visible;
+        }
+
+        Neighbors neighbors(unsigned i) const
+        {
+                return Shape<>(size_x, size_y).neighbors(i);
+        }
+
+        unsigned dist(unsigned i, unsigned j) const {
+                auto [x1, y1] = pos(i);
+                auto [x2, y2] = pos(j);
+                return std::abs((int) x1 - (int) x2) + std::abs((int) y1 - (int) y2);
+        }
+};
+
+// Whole-board scans over the struct-of-arrays grid, in a scalar version
+// and an AVX2 one that handles eight cells per step. The first call picks
+// the version the CPU supports.
+
+// Cell with the smallest dist (then index) that is not armed and owned by
+// player; none if every such cell is at infinite distance.
+unsigned nearest_foreign_scalar(const unsigned *dist, const unsigned *owner, const uint8_t *kind, unsigned n, unsigned player)
+{
+        constexpr unsigned none = std::numeric_limits<unsigned>::max();
+        unsigned best = none, best_i = none;
+        for (unsigned i = 0; i < n; ++i) {
+                bool mine = (kind[i] & (CellKind::Visible | CellKind::Blocked)) == CellKind::Visible && owner[i] == player;
+                if (!mine && dist[i] < best) {
+                        best   = dist[i];
+                        best_i = i;
+                }
+        }
+        return best_i;
+}
+
+// Appends, in index order, the armed cells of player that grow this
+// turn: cities and capitals, and all of them when land grows.
+void growing_cells_scalar(const unsigned *owner, const uint8_t *kind, unsigned n, unsigned player, bool land, std::vector<unsigned> &out)
+{
+        for (unsigned i = 0; i < n; ++i) {
+                if ((kind[i] & (CellKind::Visible | CellKind::Blocked)) == CellKind::Visible && owner[i] == player &&
+                    (land || (kind[i] & (CellKind::City | CellKind::Capital)))) {
+                        out.push_back(i);
+                }
+        }
+}
+
+#if defined(__x86_64__)
+// Lane masks of the eight cells from i: armed and owned by player.
+__attribute__((target("avx2"))) inline __m256i owned_lanes(const unsigned *owner, const uint8_t *kind, unsigned i, __m256i player, __m256i *k)
+{
+        *k = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (kind + i)));
+        __m256i armed = _mm256_cmpeq_epi32(_mm256_and_si256(*k, _mm256_set1_epi32(CellKind::Visible | CellKind::Blocked)),
+                                           _mm256_set1_epi32(CellKind::Visible));
+        return _mm256_and_si256(armed, _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *) (owner + i)), player));
+}
+
+__attribute__((target("avx2"))) unsigned nearest_foreign_avx2(const unsigned *dist, const unsigned *owner, const uint8_t *kind, unsigned n, unsigned player)
+{
+        constexpr unsigned none = std::numeric_limits<unsigned>::max();
+        const __m256i me = _mm256_set1_epi32(player);
+        // Per lane: the smallest dist so far and its first index.
+        __m256i best = _mm256_set1_epi32(-1), best_i = best;
+        __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        unsigned i = 0;
+        for (; i + 8 <= n; i += 8) {
+                __m256i k;
+                __m256i mine = owned_lanes(owner, kind, i, me, &k);
+                // Own cells become infinitely far away.
+                __m256i d = _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (dist + i)), mine);
+                __m256i m = _mm256_min_epu32(best, d);
+                // Keep the old index where the minimum did not change.
+                // Blending on the inverted mask instead is miscompiled by
+                // GCC 12 with AVX-512BW enabled (-march=native).
+                __m256i same = _mm256_cmpeq_epi32(m, best);
+                best   = m;
+                best_i = _mm256_blendv_epi8(idx, best_i, same);
+                idx    = _mm256_add_epi32(idx, _mm256_set1_epi32(8));
+        }
+        alignas(32) unsigned lane[8], lane_i[8];
+        _mm256_store_si256((__m256i *) lane, best);
+        _mm256_store_si256((__m256i *) lane_i, best_i);
+        unsigned res = none, res_d = none;
+        for (unsigned j = 0; j < 8; ++j) {
+                if (lane[j] < res_d || (lane[j] == res_d && lane[j] != none && lane_i[j] < res)) {
+                        res_d = lane[j];
+                        res   = lane_i[j];
+                }
+        }
+        unsigned tail = nearest_foreign_scalar(dist + i, owner + i, kind + i, n - i, player);
+        if (tail != none && dist[i + tail] < res_d) {
+                res = i + tail;
+        }
+        return res;
+}
+
+__attribute__((target("avx2"))) void growing_cells_avx2(const unsigned *owner, const uint8_t *kind, unsigned n, unsigned player, bool land, std::vector<unsigned> &out)
+{
+        const __m256i me = _mm256_set1_epi32(player);
+        const __m256i grows = _mm256_set1_epi32(land ? 0xff : CellKind::City | CellKind::Capital);
+        unsigned i = 0;
+        for (; i + 8 <= n; i += 8) {
+                __m256i k;
+                __m256i mine = owned_lanes(owner, kind, i, me, &k);
+                __m256i keep = _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_and_si256(k, grows), _mm256_setzero_si256()), mine);
+                for (unsigned bits = _mm256_movemask_ps(_mm256_castsi256_ps(keep)); bits; bits &= bits - 1) {
+                        out.push_back(i + __builtin_ctz(bits));
+                }
+        }
+        std::size_t from = out.size();
+        growing_cells_scalar(owner + i, kind + i, n - i, player, land, out);
+        for (std::size_t j = from; j < out.size(); ++j) {
+                out[j] += i;
+        }
+}
+#endif
+
+bool have_avx2()
+{
+#if defined(__x86_64__)
+        static const bool res = __builtin_cpu_supports("avx2");
+        return res;
+#else
+        return false;
+#endif
+}
+
+unsigned nearest_foreign(const unsigned *dist, const unsigned *owner, const uint8_t *kind, unsigned n, unsigned player)
+{
+#if defined(__x86_64__)
+        if (have_avx2()) {
+                return nearest_foreign_avx2(dist, owner, kind, n, player);
+        }
+#endif
+        return nearest_foreign_scalar(dist, owner, kind, n, player);
+}
+
+void growing_cells(const unsigned *owner, const uint8_t *kind, unsigned n, unsigned player, bool land, std::vector<unsigned> &out)
+{
+#if defined(__x86_64__)
+        if (have_avx2()) {
+                growing_cells_avx2(owner, kind, n, player, land, out);
+                return;
+        }
+#endif
+        growing_cells_scalar(owner, kind, n, player, land, out);
+}
+
+// Set of cell indices with O(1) insert, erase and lookup; iteration order
+// is unspecified but deterministic.
+struct CellSet {
+        static constexpr unsigned none = std::numeric_limits<unsigned>::max();
+
+        std::vector<unsigned> items;
+        std::vector<unsigned> pos;
+
+        explicit CellSet(unsigned cells = 0) : pos(cells, none)
+        {
+                items.reserve(cells);
+        }
+
+        bool contains(unsigned i) const
+        {
+                return pos[i] != none;
+        }
+
+        void insert(unsigned i)
+        {
+                if (pos[i] == none) {
+                        pos[i] = items.size();
+                        items.push_back(i);
+                }
+        }
+
+        void erase(unsigned i)
+        {
+                if (pos[i] != none) {
+                        items[pos[i]] = items.back();
+                        pos[items.back()] = pos[i];
+                        items.pop_back();
+                        pos[i] = none;
+                }
+        }
+
+        unsigned size() const
+        {
+                return items.size();
+        }
+
+        auto begin() const
+        {
+                return items.begin();
+        }
+
+        auto end() const
+        {
+                return items.end();
+        }
+};
+
+// Cells bucketed by the bit width of their army, so updates are O(1) and
+// the largest armies are found by scanning a few top buckets.
+struct ArmyBuckets {
+        static constexpr unsigned none = std::numeric_limits<unsigned>::max();
+
+        std::array<std::vector<unsigned>, 33> buckets;
+        std::vector<unsigned> pos;
+        std::vector<uint8_t> bucket;
+
+        explicit ArmyBuckets(unsigned cells = 0) : pos(cells, none), bucket(cells)
+        {
+                for (auto &b : buckets) {
+                        b.reserve(cells);
+                }
+        }
+
+        void erase(unsigned i)
+        {
+                if (pos[i] == none) {
+                        return;
+                }
+                auto &b = buckets[bucket[i]];
+                b[pos[i]] = b.back();
+                pos[b.back()] = pos[i];
+                b.pop_back();
+                pos[i] = none;
+        }
+
+        void set(unsigned i, unsigned army)
+        {
+                erase(i);
+                bucket[i] = 32 - (army ? __builtin_clz(army) : 32);
+                pos[i] = buckets[bucket[i]].size();
+                buckets[bucket[i]].push_back(i);
+        }
+
+        // The k cells with the largest armies, largest first.
+        template <class Army>
+        std::pmr::vector<unsigned> top(unsigned k, const Army &army, std::pmr::memory_resource *mem = std::pmr::get_default_resource()) const
+        {
+                std::pmr::vector<unsigned> res(mem);
+                for (unsigned b = buckets.size(); b-- > 0 && res.size() < k;) {
+                        res.insert(res.end(), buckets[b].begin(), buckets[b].end());
+                }
+                auto by_army = [&](unsigned a, unsigned b) {
+                        return army(a) > army(b) || (army(a) == army(b) && a < b);
+                };
+                if (res.size() > k) {
+                        std::nth_element(res.begin(), res.begin() + k, res.end(), by_army);
+                        res.resize(k);
+                }
+                std::sort(res.begin(), res.end(), by_army);
+                return res;
+        }
+};
+
+// Binary max-heap of cells by key that knows where each cell sits, so a
+// cell's key changes or the cell leaves in O(log n). Ties go to the lower
+// index.
+struct IndexedHeap {
+        static constexpr unsigned none = std::numeric_limits<unsigned>::max();
+
+        std::vector<unsigned> heap;
+        std::vector<unsigned> pos;
+        std::vector<long long> key;
+
+        explicit IndexedHeap(unsigned cells = 0) : pos(cells, none), key(cells)
+        {
+                heap.reserve(cells);
+        }
+
+        bool contains(unsigned i) const
+        {
+                return pos[i] != none;
+        }
+
+        unsigned size() const
+        {
+                return heap.size();
+        }
+
+        bool above(unsigned a, unsigned b) const
+        {
+                return key[a] > key[b] || (key[a] == key[b] && a < b);
+        }
+
+        void set(unsigned i, long long k)
+        {
+                if (pos[i] == none) {
+                        key[i] = k;
+                        pos[i] = heap.size();
+                        heap.push_back(i);
+                        sift_up(pos[i]);
+                } else if (k > key[i]) {
+                        key[i] = k;
+                        sift_up(pos[i]);
+                } else if (k < key[i]) {
+                        key[i] = k;
+                        sift_down(pos[i]);
+                }
+        }
+
+        void erase(unsigned i)
+        {
+                if (pos[i] == none) {
+                        return;
+                }
+                unsigned h = pos[i], last = heap.back();
+                heap.pop_back();
+                pos[i] = none;
+                if (h < heap.size()) {
+                        place(h, last);
+                        sift_up(h);
+                        sift_down(pos[last]);
+                }
+        }
+
+        // The k cells with the largest keys, largest first: a best-first
+        // walk from the root, O(k log k) whatever the heap size.
+        std::pmr::vector<unsigned> top(unsigned k, std::pmr::memory_resource *mem = std::pmr::get_default_resource()) const
+        {
+                std::pmr::vector<unsigned> res(mem), open(mem);
+                auto below = [&](unsigned a, unsigned b) {
+                        return above(heap[b], heap[a]);
+                };
+                if (!heap.empty()) {
+                        open.push_back(0);
+                }
+                while (!open.empty() && res.size() < k) {
+                        std::pop_heap(open.begin(), open.end(), below);
+                        unsigned h = open.back();
+                        open.pop_back();
+                        res.push_back(heap[h]);
+                        for (unsigned c = 2 * h + 1; c <= 2 * h + 2 && c < heap.size(); ++c) {
+                                open.push_back(c);
+                                std::push_heap(open.begin(), open.end(), below);
+                        }
+                }
+                return res;
+        }
+
+      private:
+        void place(unsigned h, unsigned i)
+        {
+                heap[h] = i;
+                pos[i]  = h;
+        }
+
+        void sift_up(unsigned h)
+        {
+                unsigned i = heap[h];
+                for (; h > 0 && above(i, heap[(h - 1) / 2]); h = (h - 1) / 2) {
+                        place(h, heap[(h - 1) / 2]);
+                }
+                place(h, i);
+        }
+
+        void sift_down(unsigned h)
+        {
+                unsigned i = heap[h];
+                for (unsigned c; (c = 2 * h + 1) < heap.size(); h = c) {
+                        if (c + 1 < heap.size() && above(heap[c + 1], heap[c])) {
+                                ++c;
+                        }
+                        if (!above(heap[c], i)) {
+                                break;
+                        }
+                        place(h, heap[c]);
+                }
+                place(h, i);
+        }
+};
+
+// BFS distances from one source through passable cells.
+struct DistanceField {
+        static constexpr unsigned inf = std::numeric_limits<unsigned>::max();
+
+        unsigned source = inf;
+        std::vector<unsigned> dist;
+
+        // Work lists kept between updates so that they stop allocating.
+        std::vector<unsigned> queue;
+        std::vector<std::pair<unsigned, unsigned>> heap;
+        std::vector<unsigned> lost;
+
+        DistanceField() = default;
+
+        DistanceField(const Field &field, unsigned _source) : source(_source)
+        {
+                rebuild(field);
+        }
+
+        // An invalid field with room for a board of `cells` cells, so
+        // that its first rebuild and updates do not allocate.
+        explicit DistanceField(unsigned cells)
+        {
+                dist.reserve(cells);
+                queue.reserve(cells);
+                heap.reserve(cells);
+                lost.reserve(cells);
+        }
+
+        bool valid() const
+        {
+                return source != inf;
+        }
+
+        void rebuild(const Field &field)
+        {
+                queue.reserve(field.cells());
+                dist.assign(field.cells(), inf);
+                dist[source] = 0;
+                queue.assign(1, source);
+                with_shape(field.size_x, field.size_y, [&](const auto &shape) {
+                        relax(field, shape);
+                });
+        }
+
+        // Brings the field up to date with field.blocked / field.opened.
+        // Removals invalidate only the cells that lost every shortest-path
+        // parent and re-derive them from the intact boundary; additions
+        // propagate the decrease outwards.
+        void update(const Field &field)
+        {
+                if (field.blocked.size() + field.opened.size() > field.cells() / 16 ||
+                    !field.passable(source)) {
+                        rebuild(field);
+                        return;
+                }
+                with_shape(field.size_x, field.size_y, [&](const auto &shape) {
+                        update(field, shape);
+                });
+        }
+
+      private:
+        template <class S>
+        void update(const Field &field, const S &shape)
+        {
+                if (!field.blocked.empty()) {
+                        remove(field, shape);
+                }
+                for (unsigned o : field.opened) {
+                        unsigned best = inf;
+                        for (unsigned u : shape.neighbors(o)) {
+                                if (field.passable(u) && dist[u] != inf) {
+                                        best = std::min(best, dist[u] + 1);
+                                }
+                        }
+                        if (best < dist[o]) {
+                                dist[o] = best;
+                                queue.assign(1, o);
+                                relax(field, shape);
+                        }
+                }
+        }
+
+        // BFS from the cells in queue. Field::open is closed outside the
+        // board, so an off-board u is never read from dist.
+        template <class S>
+        void relax(const Field &field, const S &shape)
+        {
+                const unsigned w = shape.size_x(), stride = w + 2;
+                for (std::size_t h = 0; h < queue.size(); ++h) {
+                        const unsigned v = queue[h], p = shape.padded(v), d = dist[v] + 1;
+                        auto visit = [&](unsigned u, unsigned pu) {
+                                if (field.open[pu] && dist[u] > d) {
+                                        dist[u] = d;
+                                        queue.push_back(u);
+                                }
+                        };
+                        visit(v - 1, p - 1);
+                        visit(v + 1, p + 1);
+                        visit(v - w, p - stride);
+                        visit(v + w, p + stride);
+                }
+        }
+
+        // Min-heap on (distance, cell) over the heap vector.
+        void push(unsigned d, unsigned v)
+        {
+                heap.push_back({d, v});
+                std::push_heap(heap.begin(), heap.end(), std::greater<>());
+        }
+
+        std::pair<unsigned, unsigned> pop()
+        {
+                std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+                auto top = heap.back();
+                heap.pop_back();
+                return top;
+        }
+
+        template <class S>
+        void remove(const Field &field, const S &shape)
+        {
+                // Collect the invalidated region in order of the old
+                // distances, so a cell's possible parents are always final.
+                heap.clear();
+                lost.clear();
+                for (unsigned b : field.blocked) {
+                        if (dist[b] == inf) {
+                                continue;
+                        }
+                        for (unsigned u : shape.neighbors(b)) {
+                                if (dist[u] == dist[b] + 1) {
+                                        push(dist[u], u);
+                                }
+                        }
+                        dist[b] = inf;
+                }
+                while (!heap.empty()) {
+                        auto [d, v] = pop();
+                        if (dist[v] != d) {
+                                continue;
+                        }
+                        bool supported = false;
+                        for (unsigned u : shape.neighbors(v)) {
+                                if (field.passable(u) && dist[u] != inf && dist[u] + 1 == d) {
+                                        supported = true;
+                                        break;
+                                }
+                        }
+                        if (supported) {
+                                continue;
+                        }
+                        dist[v] = inf;
+                        lost.push_back(v);
+                        for (unsigned u : shape.neighbors(v)) {
+                                if (dist[u] == d + 1) {
+                                        push(d + 1, u);
+                                }
+                        }
+                }
+
+                for (unsigned v : lost) {
+                        if (!field.passable(v)) {
+                                continue;
+                        }
+                        for (unsigned u : shape.neighbors(v)) {
+                                if (field.passable(u) && dist[u] != inf && dist[u] + 1 < dist[v]) {
+                                        dist[v] = dist[u] + 1;
+                                }
+                        }
+                        if (dist[v] != inf) {
+                                push(dist[v], v);
+                        }
+                }
+                while (!heap.empty()) {
+                        auto [d, v] = pop();
+                        if (d != dist[v]) {
+                                continue;
+                        }
+                        for (unsigned u : shape.neighbors(v)) {
+                                if (field.passable(u) && dist[u] > d + 1) {
+                                        dist[u] = d + 1;
+                                        push(d + 1, u);
+                                }
+                        }
+                }
+        }
+};
+
+// Distance fields that persist across turns: one from our capital, one
+// per known enemy capital and a few recently used BFS sources. All of
+// them are allocated up front, invalid until first used.
+struct DistanceCache {
+        static constexpr unsigned capacity = 8;
+
+        DistanceField home;
+        std::unordered_map<unsigned, DistanceField> capitals;
+        std::list<DistanceField> recent;
+
+        DistanceCache(unsigned cells, unsigned players) : home(cells)
+        {
+                for (unsigned p = 1; p <= players; ++p) {
+                        capitals.emplace(p, DistanceField(cells));
+                }
+                for (unsigned j = 0; j < capacity; ++j) {
+                        recent.emplace_back(cells);
+                }
+        }
+
+        const DistanceField &capital(const Field &field, unsigned owner, unsigned cell, bool is_home)
+        {
+                DistanceField &f = is_home ? home : capitals[owner];
+                if (f.source != cell) {
+                        f.source = cell;
+                        f.rebuild(field);
+                }
+                return f;
+        }
+
+        const DistanceField &from(const Field &field, unsigned source)
+        {
+                for (auto it = recent.begin(); it != recent.end(); ++it) {
+                        if (it->source == source) {
+                                recent.splice(recent.begin(), recent, it);
+                                return recent.front();
+                        }
+                }
+                PROFILE_SCOPE("distances.from_miss");
+                // Recycle the least recently used field's storage.
+                recent.splice(recent.begin(), recent, std::prev(recent.end()));
+                recent.front().source = source;
+                recent.front().rebuild(field);
+                return recent.front();
+        }
+
+        void update(const Field &field)
+        {
+                if (field.blocked.empty() && field.opened.empty()) {
+                        return;
+                }
+                PROFILE_SCOPE("distances.update");
+                if (home.valid()) {
+                        home.update(field);
+                }
+                for (auto &[owner, f] : capitals) {
+                        if (f.valid()) {
+                                f.update(field);
+                        }
+                }
+                for (auto &f : recent) {
+                        if (f.valid()) {
+                                f.update(field);
+                        }
+                }
+        }
+};
+
+// Army-weighted distances from one source. Entering a cell costs a move
+// plus the army its capture_cost spends, capped at cap so that cells the
+// army cannot take keep a finite price; left is the army that arrives
+// along prev, which picks up our own land on the way. cap is further
+// bounded by max_weight, the board's width plus height: a capture dearer
+// than crossing the board is priced as if it cost that. Weights are
+// integers in [1, max_weight + 1], so Dial's algorithm applies: a ring of
+// max_weight + 2 buckets indexed by distance instead of a heap, each pop
+// O(1). The ring and its entries are sized for the board up front, so a
+// run does not allocate.
+struct CostField {
+        static constexpr unsigned inf = DistanceField::inf;
+
+        unsigned max_weight = 0;
+
+        std::vector<unsigned> dist;
+        std::vector<unsigned> prev;
+        std::vector<long long> left;
+        // Each passable cell's capture cost, priced once per run.
+        std::vector<int> price;
+        // Bucket b is a FIFO list of queued cells, threaded from head[b] to
+        // tail[b] through entry and next; inf marks the end and an empty
+        // bucket. A cell is queued at most once per neighbour that
+        // settles, so 4 * cells + 1 entries are enough. Every run ends
+        // with all buckets empty.
+        std::vector<unsigned> head, tail;
+        std::vector<unsigned> entry, next;
+
+        explicit CostField(const Field &field)
+            : max_weight(field.size_x + field.size_y), dist(field.cells()), prev(field.cells()),
+              left(field.cells()), price(field.cells()), head(max_weight + 2, inf), tail(max_weight + 2, inf),
+              entry(4 * field.cells() + 1), next(4 * field.cells() + 1)
+        {
+        }
+
+        // cost(i) is capture_cost(i): nullopt exactly where the cell is
+        // not passable, negative on our own land.
+        template <class Cost>
+        void run(const Field &field, unsigned source, long long army, unsigned cap, const Cost &cost)
+        {
+                dist.assign(field.cells(), inf);
+                prev.assign(field.cells(), inf);
+                left.assign(field.cells(), 0);
+                price.resize(field.cells());
+                for (unsigned i = 0; i < field.cells(); ++i) {
+                        price[i] = cost(i).value_or(0);
+                }
+                cap = std::min(cap, max_weight);
+                const unsigned span = cap + 2;
+
+                unsigned used = 0;
+                auto push = [&](unsigned b, unsigned v) {
+                        entry[used] = v;
+                        next[used]  = inf;
+                        if (head[b] == inf) {
+                                head[b] = used;
+                        } else {
+                                next[tail[b]] = used;
+                        }
+                        tail[b] = used++;
+                };
+                dist[source] = 0;
+                left[source] = army;
+                push(0, source);
+                unsigned pending = 1;
+                with_shape(field.size_x, field.size_y, [&](const auto &shape) {
+                        const unsigned w = shape.size_x(), stride = w + 2;
+                        // Pushes land at most cap + 1 ahead, so bucket
+                        // d % span only ever holds distance d; entries
+                        // superseded by a shorter one are skipped.
+                        for (unsigned d = 0; pending > 0; ++d) {
+                                const unsigned b = d % span;
+                                for (unsigned e = head[b]; e != inf; e = next[e]) {
+                                        --pending;
+                                        const unsigned v = entry[e];
+                                        if (dist[v] != d) {
+                                                continue;
+                                        }
+                                        const unsigned p = shape.padded(v);
+                                        auto visit = [&](unsigned u, unsigned pu) {
+                                                if (!field.open[pu]) {
+                                                        return;
+                                                }
+                                                unsigned nd = d + 1 + std::min<unsigned>(std::max(price[u], 0), cap);
+                                                if (nd < dist[u]) {
+                                                        dist[u] = nd;
+                                                        prev[u] = v;
+                                                        left[u] = left[v] - price[u];
+                                                        push(nd % span, u);
+                                                        ++pending;
+                                                }
+                                        };
+                                        visit(v - 1, p - 1);
+                                        visit(v + 1, p + 1);
+                                        visit(v - w, p - stride);
+                                        visit(v + w, p + stride);
+                                }
+                                head[b] = inf;
+                        }
+                });
+        }
+};
+
+// What we last saw of every cell, kept through the fog, and a guess at
+// where each enemy capital is. update() only looks at Field::changed.
+struct Belief {
+        // Owner, army and kind at the last turn a cell was visible; seen is
+        // that turn, 0 for cells never seen. kind keeps CellKind::Visible
+        // only while the cell still is.
+        std::vector<unsigned> owner;
+        std::vector<unsigned> size;
+        std::vector<uint8_t> kind;
+        std::vector<unsigned> seen;
+        // No capital can be here: seen as something else, or reported as a
+        // hidden obstacle (capitals are reported as plain fog).
+        std::vector<bool> ruled_out;
+
+        // Cells last seen owned by each player: count and coordinate sums.
+        struct Territory {
+                unsigned cells = 0;
+                unsigned long long sum_x = 0;
+                unsigned long long sum_y = 0;
+        };
+        std::vector<Territory> territory;
+
+        Belief(unsigned cells, unsigned players)
+            : owner(cells), size(cells), kind(cells), seen(cells), ruled_out(cells), territory(players + 1)
+        {
+        }
+
+        void claim(const Field &field, unsigned i, int sign)
+        {
+                if (owner[i] == 0 || owner[i] >= territory.size()) {
+                        return;
+                }
+                auto [x, y] = field.pos(i);
+                auto &t = territory[owner[i]];
+                t.cells += sign;
+                t.sum_x += sign * (long long) x;
+                t.sum_y += sign * (long long) y;
+        }
+
+        void update(const Field &field, unsigned turn)
+        {
+                for (unsigned i : field.changed) {
+                        if (field.visible(i)) {
+                                claim(field, i, -1);
+                                owner[i] = field.owner[i];
+                                size[i]  = field.size[i];
+                                kind[i]  = field.kind[i];
+                                seen[i]  = turn;
+                                claim(field, i, 1);
+                                if (!(field.kind[i] & CellKind::Capital)) {
+                                        ruled_out[i] = true;
+                                }
+                        } else {
+                                if (kind[i] & CellKind::Visible) {
+                                        kind[i] &= ~CellKind::Visible;
+                                        seen[i] = turn - 1;
+                                }
+                                if (field.kind[i] & CellKind::Blocked) {
+                                        ruled_out[i] = true;
+                                }
+                        }
+                }
+        }
+
+        unsigned last_seen(const Field &field, unsigned i, unsigned turn) const
+        {
+                return field.visible(i) ? turn : seen[i];
+        }
+
+        // Army expected on i now: what was there, plus what an owned city
+        // or capital (every turn) and owned land (every 25th) grew since.
+        unsigned expected_size(const Field &field, unsigned i, unsigned turn) const
+        {
+                if (field.visible(i)) {
+                        return field.size[i];
+                }
+                if (seen[i] == 0 || owner[i] == 0) {
+                        return size[i];
+                }
+                unsigned grown = turn / 25 - seen[i] / 25;
+                if (kind[i] & (CellKind::City | CellKind::Capital)) {
+                        grown = turn - seen[i];
+                }
+                return size[i] + grown;
+        }
+
+        // Territory grows around the capital but we see mostly the side
+        // facing us: start at the centroid of what we saw of p and move
+        // away from home by the radius of the land we did not see.
+        std::pair<double, double> center(const Field &field, unsigned p, unsigned land, std::optional<unsigned> home) const
+        {
+                const auto &t = territory[p];
+                double cx = (double) t.sum_x / t.cells, cy = (double) t.sum_y / t.cells;
+                if (home && land > t.cells) {
+                        auto [hx, hy] = field.pos(*home);
+                        double dx = cx - hx, dy = cy - hy, len = std::hypot(dx, dy);
+                        double shift = std::sqrt(land / 2.0) * (1 - (double) t.cells / land);
+                        if (len > 0) {
+                                cx += dx / len * shift;
+                                cy += dy / len * shift;
+                        }
+                }
+                cx = std::clamp(cx, 0.0, field.size_x - 1.0);
+                cy = std::clamp(cy, 0.0, field.size_y - 1.0);
+                return {cx, cy};
+        }
+
+        bool possible_capital(const Field &field, unsigned i) const
+        {
+                return !ruled_out[i] && !field.visible(i);
+        }
+
+        // Relative likelihood that p's capital is on i: a Gaussian around
+        // center() as wide as p's territory, zero where it cannot be.
+        double capital_likelihood(const Field &field, unsigned p, unsigned land, std::optional<unsigned> home, unsigned i) const
+        {
+                if (p >= territory.size() || territory[p].cells == 0 || !possible_capital(field, i)) {
+                        return 0;
+                }
+                auto [cx, cy] = center(field, p, land, home);
+                auto [x, y]   = field.pos(i);
+                double d = std::abs(x - cx) + std::abs(y - cy);
+                double sigma = std::max(1.0, std::sqrt(land / 2.0));
+                return std::exp(-d * d / (2 * sigma * sigma));
+        }
+
+        // Most likely cell for p's capital: the possible cell nearest to
+        // center(), found by walking Manhattan rings outwards.
+        std::optional<unsigned> likely_capital(const Field &field, unsigned p, unsigned land, std::optional<unsigned> home) const
+        {
+                if (p >= territory.size() || territory[p].cells == 0) {
+                        return std::nullopt;
+                }
+                auto [fx, fy] = center(field, p, land, home);
+                int cx = std::lround(fx), cy = std::lround(fy);
+                int w = field.size_x, h = field.size_y;
+                for (int d = 0; d < w + h; ++d) {
+                        for (int dx = -d; dx <= d; ++dx) {
+                                int rest = d - std::abs(dx);
+                                for (int dy : {-rest, rest}) {
+                                        int x = cx + dx, y = cy + dy;
+                                        if (x >= 0 && x < w && y >= 0 && y < h && possible_capital(field, y * w + x)) {
+                                                return y * w + x;
+                                        }
+                                        if (rest == 0) {
+                                                break;
+                                        }
+                                }
+                        }
+                }
+                return std::nullopt;
+        }
+};
+
+// Copy-cheap snapshot of the board around a fight for the attack search:
+// at most span x span cells in fixed arrays, so a rollout starts with a
+// plain copy; the terrain, which rollouts do not change, is shared. Side 1
+// is us, side 2 the enemy we fight; other players and hidden cells are
+// neutral ground. Moves follow Game::apply, except that taking a capital
+// simply ends the fight.
+struct Skirmish {
+        static constexpr unsigned span      = 9;
+        static constexpr unsigned max_cells = span * span;
+        // Armies per side that moves are considered for.
+        static constexpr unsigned armies = 3;
+
+        enum : uint8_t { Blocked = 1, Grows = 2, Capital = 4 };
+
+        struct Terrain {
+                unsigned w = 0, h = 0;
+                std::array<uint8_t, max_cells> flags{};
+                // Passable neighbours, and the cities and capitals.
+                std::array<Neighbors, max_cells> adj;
+                std::array<uint8_t, max_cells> growing;
+                unsigned grow_count = 0;
+
+                // Derives adj and growing from w, h and flags.
+                void finish()
+                {
+                        for (unsigned i = 0; i < w * h; ++i) {
+                                adj[i] = {};
+                                for (unsigned u : Shape<>(w, h).neighbors(i)) {
+                                        if (!(flags[u] & Blocked)) {
+                                                adj[i].push_back(u);
+                                        }
+                                }
+                                if (flags[i] & Grows) {
+                                        growing[grow_count++] = i;
+                                }
+                        }
+                }
+        };
+
+        const Terrain *terrain = nullptr;
+        unsigned turn = 0;
+        // Side whose capital fell, 0 while both stand.
+        unsigned lost = 0;
+        std::array<uint8_t, max_cells> side{};
+        std::array<unsigned, max_cells> army{};
+
+        unsigned cells() const
+        {
+                return terrain->w * terrain->h;
+        }
+
+        const Neighbors &neighbors(unsigned i) const
+        {
+                return terrain->adj[i];
+        }
+
+        void move(unsigned s, unsigned from, unsigned to)
+        {
+                if (side[from] != s || army[from] <= 1) {
+                        return;
+                }
+                unsigned units = army[from] - 1;
+                army[from] = 1;
+                if (side[to] == s) {
+                        army[to] += units;
+                } else if (units > army[to]) {
+                        if ((terrain->flags[to] & Capital) && side[to]) {
+                                lost = side[to];
+                        }
+                        army[to] = units - army[to];
+                        side[to] = s;
+                } else {
+                        army[to] -= units;
+                }
+        }
+
+        void end_turn()
+        {
+                ++turn;
+                if (turn % 25 == 0) {
+                        for (unsigned i = 0; i < cells(); ++i) {
+                                army[i] += side[i] != 0;
+                        }
+                        return;
+                }
+                for (unsigned k = 0; k < terrain->grow_count; ++k) {
+                        unsigned i = terrain->growing[k];
+                        army[i] += side[i] != 0;
+                }
+        }
+
+        // Army plus two per cell of land, ours minus the enemy's.
+        long long score() const
+        {
+                long long res = 0;
+                for (unsigned i = 0; i < cells(); ++i) {
+                        if (side[i]) {
+                                res += (side[i] == 1 ? 1 : -1) * ((long long) army[i] + 2);
+                        }
+                }
+                return res;
+        }
+
+        // Immediate gain of moving side s's army from i to u: enemy units
+        // destroyed, cells taken, a little for merging towards the front.
+        long long gain(unsigned s, unsigned i, unsigned u) const
+        {
+                const long long units = army[i] - 1;
+                if (side[u] == s) {
+                        return 0;
+                }
+                long long hit = std::min<long long>(units, army[u]);
+                if (units <= army[u]) {
+                        return (side[u] ? 2 * hit : 0) - units / 2;
+                }
+                return (side[u] ? 2 * hit : hit / 4) + 3 + ((terrain->flags[u] & Capital) && side[u] ? 1000 : 0);
+        }
+
+        // The up to `armies` largest armies of side s that can move, largest
+        // first; returns how many were found.
+        unsigned largest(unsigned s, unsigned *out) const
+        {
+                unsigned n = 0;
+                for (unsigned i = 0; i < cells(); ++i) {
+                        if (side[i] != s || army[i] <= 1 || (n == armies && army[i] <= army[out[n - 1]])) {
+                                continue;
+                        }
+                        unsigned j = std::min(n, armies - 1);
+                        for (; j > 0 && army[out[j - 1]] < army[i]; --j) {
+                                out[j] = out[j - 1];
+                        }
+                        out[j] = i;
+                        n = std::min(n + 1, armies);
+                }
+                return n;
+        }
+
+        // Rollout policy over the moves of side s's largest armies: the
+        // best gain, ties broken at random, or with probability 1/8 a
+        // uniformly random move; {0, 0} if s cannot move.
+        template <class Rng>
+        std::pair<unsigned, unsigned> policy(unsigned s, Rng &rnd) const
+        {
+                const bool explore = rnd() % 8 == 0;
+                std::pair<unsigned, unsigned> best{0, 0};
+                long long best_key = std::numeric_limits<long long>::min();
+                unsigned from[armies];
+                unsigned n = largest(s, from);
+                for (unsigned k = 0; k < n; ++k) {
+                        unsigned i = from[k];
+                        for (unsigned u : neighbors(i)) {
+                                long long key = (explore ? 0 : gain(s, i, u) * 8) + (long long) (rnd() % 8);
+                                if (key > best_key) {
+                                        best_key = key;
+                                        best     = {i, u};
+                                }
+                        }
+                }
+                return best;
+        }
+};
+
+// Wall-clock limit for a search, optionally cut short by a flag another
+// thread raises; a default-constructed Deadline never expires.
+struct Deadline {
+        using clock = std::chrono::steady_clock;
+
+        std::optional<clock::time_point> at;
+        const std::atomic<bool> *cancel = nullptr;
+
+        static Deadline after(clock::duration budget)
+        {
+                return {clock::now() + budget};
+        }
+
+        bool enabled() const
+        {
+                return at.has_value();
+        }
+
+        bool expired() const
+        {
+                return (cancel && cancel->load(std::memory_order_relaxed)) || (at && clock::now() >= *at);
+        }
+
+        // A deadline that leaves this one `fraction` of the remaining time.
+        Deadline share(double fraction) const
+        {
+                if (!at) {
+                        return {std::nullopt, cancel};
+                }
+                auto now = clock::now();
+                return {now + std::chrono::duration_cast<clock::duration>((*at - now) * fraction), cancel};
+        }
+};
+
+struct SearchStats {
+        unsigned long long nodes = 0;
+        unsigned depth           = 0;
+        unsigned passes          = 0;
+        // Transposition lookups, the ones that found a known state, and
+        // the nodes those states' subtrees took when first searched.
+        unsigned long long probes = 0;
+        unsigned long long hits   = 0;
+        unsigned long long saved  = 0;
+
+        void merge(const SearchStats &other)
+        {
+                nodes += other.nodes;
+                depth = std::max(depth, other.depth);
+                passes += other.passes;
+                probes += other.probes;
+                hits += other.hits;
+                saved += other.saved;
+        }
+};
+
+// Zobrist keys of path search states. A state is the set of cells on the
+// path and its last cell, the only things the rest of the search depends
+// on: its key is the xor of cell[i] over the path and head[last], updated
+// in O(1) on push and pop. The seed is fixed, so keys are reproducible.
+struct Zobrist {
+        std::vector<uint64_t> cell;
+        std::vector<uint64_t> head;
+
+        explicit Zobrist(unsigned cells) : cell(cells), head(cells)
+        {
+                std::mt19937_64 rnd(0x2b992ddfa23249d6);
+                for (unsigned i = 0; i < cells; ++i) {
+                        cell[i] = rnd();
+                        head[i] = rnd();
+                }
+        }
+};
+
+// Fixed-size table of path search states whose subtree was searched to
+// the end, shared by the threads of a multi-start search and by State
+// copies. An entry is two atomic words, key ^ data and data, written
+// without locks: a torn entry fails the key check and reads as a miss.
+// data is generation << 32 | depth << 16 | subtree nodes, where depth is
+// the depth budget the subtree was searched with, 0xffff if no budget cut
+// it short. Every search takes a new generation, which invalidates all
+// older entries without clearing the table: nothing carries over between
+// searches or turns, since capture costs change every turn. States are
+// only reused within one search and its anytime passes.
+struct TranspositionTable {
+        struct Entry {
+                std::atomic<uint64_t> check{0};
+                std::atomic<uint64_t> data{0};
+        };
+
+        std::unique_ptr<Entry[]> entries;
+        uint64_t mask;
+        std::atomic<uint32_t> generation{0};
+
+        explicit TranspositionTable(unsigned bits)
+            : entries(new Entry[std::size_t(1) << bits]), mask((uint64_t(1) << bits) - 1)
+        {
+        }
+
+        uint32_t begin()
+        {
+                return generation.fetch_add(1, std::memory_order_relaxed) + 1;
+        }
+
+        static constexpr unsigned unbounded = 0xffff;
+
+        // Subtree node count if key was searched in generation gen with a
+        // depth budget of at least depth.
+        std::optional<unsigned> probe(uint64_t key, uint32_t gen, unsigned depth) const
+        {
+                const Entry &e = entries[key & mask];
+                uint64_t data = e.data.load(std::memory_order_relaxed);
+                if ((e.check.load(std::memory_order_relaxed) ^ data) != key || data >> 32 != gen ||
+                    (data >> 16 & 0xffff) < std::min(depth, unbounded)) {
+                        return std::nullopt;
+                }
+                return data & 0xffff;
+        }
+
+        // Budgets that do not fit are stored as the largest bounded one, so
+        // a probe never finds more than was searched.
+        void store(uint64_t key, uint32_t gen, unsigned depth, unsigned nodes)
+        {
+                depth = depth == unbounded ? depth : std::min(depth, unbounded - 1);
+                uint64_t data = uint64_t(gen) << 32 | uint64_t(depth) << 16 | std::min(nodes, 0xffffu);
+                Entry &e = entries[key & mask];
+                e.check.store(key ^ data, std::memory_order_relaxed);
+                e.data.store(data, std::memory_order_relaxed);
+        }
+};
+
+// Fixed set of threads running batches of indexed jobs. The calling thread
+// works on the batch too, and run() returns once every job has finished.
+// Batches from different threads are serialized.
+struct WorkerPool {
+        std::vector<std::thread> workers;
+        std::mutex batch;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable done;
+        const std::function<void(unsigned)> *job = nullptr;
+        // The caller's ProfileGame, which the batch's jobs record into.
+        ProfileGame *profile = nullptr;
+        unsigned next    = 0;
+        unsigned count   = 0;
+        unsigned pending = 0;
+        bool stop        = false;
+
+        explicit WorkerPool(unsigned threads)
+        {
+                for (unsigned t = 1; t < threads; ++t) {
+                        workers.emplace_back([this] {
+                                std::unique_lock<std::mutex> g(lock);
+                                while (true) {
+                                        wake.wait(g, [&] {
+                                                return stop || (job && next < count);
+                                        });
+                                        if (stop) {
+                                                return;
+                                        }
+                                        work(g);
+                                }
+                        });
+                }
+        }
+
+        ~WorkerPool()
+        {
+                {
+                        std::lock_guard<std::mutex> g(lock);
+                        stop = true;
+                }
+                wake.notify_all();
+                for (auto &w : workers) {
+                        w.join();
+                }
+        }
+
+        void run(unsigned n, const std::function<void(unsigned)> &f)
+        {
+                std::lock_guard<std::mutex> serial(batch);
+                std::unique_lock<std::mutex> g(lock);
+                job     = &f;
+                profile = profile_current();
+                next    = 0;
+                count   = n;
+                pending = n;
+                wake.notify_all();
+                work(g);
+                done.wait(g, [&] {
+                        return pending == 0;
+                });
+                job = nullptr;
+        }
+
+        // Takes jobs of the current batch until all are started; g is held
+        // on entry and exit.
+        void work(std::unique_lock<std::mutex> &g)
+        {
+                while (job && next < count) {
+                        unsigned j = next++;
+                        const auto &f = *job;
+                        ProfileGameScope scope(profile);
+                        g.unlock();
+                        f(j);
+                        g.lock();
+                        if (--pending == 0) {
+                                done.notify_all();
+                        }
+                }
+        }
+};
+
+// Monotonic memory for one turn's search structures, released in one go
+// by reset(). The buffer grows to cover the largest turn seen so far, so a
+// warmed-up turn does not touch the heap. Copies start out empty.
+struct TurnArena {
+        // Serves what did not fit into the buffer and remembers how much.
+        struct Overflow : std::pmr::memory_resource {
+                std::size_t bytes = 0;
+
+                void *do_allocate(std::size_t n, std::size_t align) override
+                {
+                        bytes += n;
+                        return std::pmr::new_delete_resource()->allocate(n, align);
+                }
+
+                void do_deallocate(void *p, std::size_t n, std::size_t align) override
+                {
+                        std::pmr::new_delete_resource()->deallocate(p, n, align);
+                }
+
+                bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+                {
+                        return this == &other;
+                }
+        };
+
+        std::vector<std::byte> buffer;
+        Overflow overflow;
+        std::optional<std::pmr::monotonic_buffer_resource> resource;
+
+        explicit TurnArena(std::size_t capacity = 1 << 16) : buffer(capacity)
+        {
+                reset();
+        }
+
+        TurnArena(const TurnArena &other) : TurnArena(other.buffer.size())
+        {
+        }
+
+        TurnArena &operator=(const TurnArena &) = delete;
+
+        std::pmr::memory_resource *get()
+        {
+                return &*resource;
+        }
+
+        void reset()
+        {
+                resource.reset();
+                if (overflow.bytes) {
+                        buffer.resize(buffer.size() + 2 * overflow.bytes);
+                        overflow.bytes = 0;
+                }
+                resource.emplace(buffer.data(), buffer.size(), &overflow);
+        }
+};
+
+enum class Planner { Dfs, Beam };
+
+enum class Gather { Path, Tree };
+
+enum class Attack { Heuristic, Mcts };
+
+enum class Route { Steps, Army };
+
+struct Options {
+        Planner planner     = Planner::Dfs;
+        Gather gather       = Gather::Path;
+        Attack attack       = Attack::Heuristic;
+        Route route         = Route::Army;
+        unsigned beam_width = 64;
+        unsigned tt_bits    = 16;
+        bool fast_input     = true;
+        unsigned time_ms    = 0;
+        bool speculate      = false;
+        bool belief         = false;
+        bool commit         = false;
+        bool frontier       = false;
+        unsigned threads    = 1;
+        std::string record;
+        std::string profile_json;
+        std::optional<unsigned> max_allocs;
+};
+
+struct State {
+        unsigned player_count;
+        unsigned player_id;
+
+        Field field;
+        std::vector<PlayerInfo> info;
+
+        unsigned turn_num;
+
+        std::unordered_map<unsigned, std::pair<unsigned, unsigned>> capital;
+        bool exists_not_me = false;
+        DistanceCache distances;
+
+        // Maintained from Field::changed by update_info.
+        Belief belief;
+        CellSet mine;
+        CellSet enemy;
+        ArmyBuckets mine_by_army;
+        // Our cells that can take a neighbour, keyed by frontier_value;
+        // only kept with --frontier.
+        IndexedHeap frontier;
+
+        std::mt19937 rnd;
+        Options options;
+
+        Deadline deadline;
+        SearchStats stats;
+
+        // Runs multi-start searches with --threads > 1; shared by copies.
+        std::shared_ptr<WorkerPool> pool;
+
+        // Transposition pruning for --planner=dfs; shared by copies too.
+        Zobrist zobrist;
+        std::shared_ptr<TranspositionTable> table;
+
+        // Search memory, reset every turn by ingest(); multi-start search j
+        // uses arenas[j], everything else arenas[0].
+        std::vector<TurnArena> arenas;
+
+        State(unsigned x, unsigned y, unsigned _count, unsigned _id, const Options &_options = {})
+            : player_count(_count), player_id(_id), field(x, y, _id),
+              info(_count + 1), turn_num(0), distances(field.cells(), _count), belief(field.cells(), _count), mine(field.cells()),
+              enemy(field.cells()), mine_by_army(field.cells()), frontier(field.cells()), options(_options),
+              zobrist(field.cells()), costs(field)
+        {
+                rnd.seed(57444179);
+                if (player_id > player_count) {
+                        throw std::runtime_error("Invalid player id");
+                }
+                if (options.threads > 1) {
+                        pool = std::make_shared<WorkerPool>(options.threads);
+                }
+                arenas.resize(std::max(1u, options.threads));
+                greedy_path.reserve(field.cells());
+                collect_path.reserve(field.cells());
+                gather_moves.reserve(field.cells());
+                if (options.planner == Planner::Dfs && options.tt_bits) {
+                        table = std::make_shared<TranspositionTable>(options.tt_bits);
+                }
+        }
+
+        void refresh(unsigned i)
+        {
+                if (my_units(i) > 0) {
+                        mine.insert(i);
+                        mine_by_army.set(i, field.size[i]);
+                } else {
+                        mine.erase(i);
+                        mine_by_army.erase(i);
+                }
+
+                if (field.armed(i) && field.owner[i] != player_id && field.owner[i] != 0) {
+                        enemy.insert(i);
+                } else {
+                        enemy.erase(i);
+                }
+
+                if (field.armed(i) && (field.kind[i] & CellKind::Capital)) {
+                        capital[field.owner[i]] = {i, field.size[i]};
+                }
+        }
+
+        void update_info()
+        {
+                PROFILE_SCOPE("update_info");
+                for (unsigned i : field.changed) {
+                        refresh(i);
+                }
+                belief.update(field, turn_num);
+                // A cell's value depends on it and its neighbours.
+                if (options.frontier) {
+                        for (unsigned i : field.changed) {
+                                refresh_frontier(i);
+                                for (unsigned u : field.neighbors(i)) {
+                                        refresh_frontier(u);
+                                }
+                        }
+                }
+                exists_not_me = exists_not_me || enemy.size() > 0;
+                for (const auto &[owner, cap] : capital) {
+                        distances.capital(field, owner, cap.first, owner == player_id);
+                }
+        }
+
+        template <class Input>
+        void read_next(Input &in)
+        {
+                PROFILE_SCOPE("read_next");
+                read_input(in);
+                ingest();
+        }
+
+        // The parsing half of read_next: player infos and the table, with
+        // none of the caches updated yet.
+        template <class Input>
+        void read_input(Input &in)
+        {
+                ++turn_num;
+                for (unsigned i = 1; i <= player_count; ++i) {
+                        in >> info[i];
+                }
+
+                {
+                        PROFILE_SCOPE("read_table");
+                        field.read_table(in);
+                }
+        }
+
+        // Brings the distance caches and indexes up to date with the cells
+        // the last update of field recorded as changed.
+        void ingest()
+        {
+                for (auto &a : arenas) {
+                        a.reset();
+                }
+                distances.update(field);
+                update_info();
+        }
+
+        // Best guess at p's capital: where we saw it, else Belief's.
+        std::optional<unsigned> likely_capital(unsigned p) const
+        {
+                if (auto it = capital.find(p); it != capital.end()) {
+                        return it->second.first;
+                }
+                std::optional<unsigned> home;
+                if (auto it = capital.find(player_id); it != capital.end()) {
+                        home = it->second.first;
+                }
+                return belief.likely_capital(field, p, info[p].land, home);
+        }
+
+        std::pmr::memory_resource *arena(std::size_t j = 0)
+        {
+                return arenas[j % arenas.size()].get();
+        }
+
+        // Advances to the state the judge should report next if nothing but
+        // `turn` and army growth happens: cities and capitals grow every
+        // turn, all land every 25th. Cells the move reveals and opponents'
+        // moves cannot be predicted. Changes are stored in index order, as
+        // read_table does, so the indexes end up as after a real read.
+        void predict(const Turn &turn)
+        {
+                auto owner = field.owner;
+                auto size  = field.size;
+                if (const auto *move = std::get_if<Move>(&turn)) {
+                        unsigned src = field.index(move->src), dest = field.index(move->dest);
+                        unsigned units = move->type == MoveType::All ? size[src] - 1 : size[src] / 2;
+                        size[src] -= units;
+                        if (owner[dest] == player_id) {
+                                size[dest] += units;
+                        } else if (units > size[dest]) {
+                                size[dest]  = units - size[dest];
+                                owner[dest] = player_id;
+                        } else {
+                                size[dest] -= units;
+                        }
+                }
+                const bool land_grows = turn_num % 25 == 0;
+                ++turn_num;
+
+                // Only growing cells and the move's two can differ.
+                std::vector<unsigned> touched;
+                growing_cells(owner.data(), field.kind.data(), field.cells(), player_id, land_grows, touched);
+                for (unsigned i : touched) {
+                        ++size[i];
+                }
+                if (const auto *move = std::get_if<Move>(&turn)) {
+                        touched.push_back(field.index(move->src));
+                        touched.push_back(field.index(move->dest));
+                        std::sort(touched.begin(), touched.end());
+                        touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+                }
+
+                field.begin_update();
+                for (unsigned i : touched) {
+                        field.store(i, field.kind[i], owner[i], size[i]);
+                }
+                ingest();
+        }
+
+
+        std::optional<int> capture_cost(unsigned i) const {
+                if (!field.passable(i)) {
+                        return std::nullopt;
+                }
+                if (!field.visible(i)) {
+                        // With --belief, land last seen as an enemy's costs
+                        // what has probably grown on it since.
+                        if (options.belief && belief.owner[i] != 0 && belief.owner[i] != player_id) {
+                                return (int) belief.expected_size(field, i, turn_num) + 1;
+                        }
+                        return 1;
+                }
+                if (field.owner[i] == player_id) {
+                        return 1 - (int) field.size[i];
+                } else {
+                        return field.size[i] + 1;
+                }
+        }
+
+        // Search state of gen_path. metric always describes cur: it is
+        // extended on push and restored on pop, so comparing candidates
+        // never walks a path. best is only copied on strict improvement.
+        // The containers live in a turn arena, and so do copies.
+        template <class Metric>
+        struct PathGeneratorState {
+                std::mt19937 rnd;
+                std::pmr::vector<unsigned> cur;
+                std::pmr::vector<uint64_t> used;
+                unsigned units;
+                unsigned iterations = 0;
+                unsigned depth = 0;
+                // Zobrist key of the cells in cur, and the transposition
+                // table generation of the current search, 0 for none.
+                uint64_t key = 0;
+                uint32_t generation = 0;
+                Metric metric{};
+                std::pmr::vector<unsigned> best;
+                Metric best_metric{};
+                bool truncated = false;
+                bool stopped = false;
+                SearchStats stats;
+
+                explicit PathGeneratorState(std::pmr::memory_resource *mem) : cur(mem), used(mem), best(mem)
+                {
+                }
+
+                PathGeneratorState(const PathGeneratorState &o)
+                    : rnd(o.rnd), cur(o.cur, o.cur.get_allocator()), used(o.used, o.used.get_allocator()),
+                      units(o.units), iterations(o.iterations), depth(o.depth), key(o.key),
+                      generation(o.generation), metric(o.metric),
+                      best(o.best, o.best.get_allocator()), best_metric(o.best_metric), truncated(o.truncated),
+                      stopped(o.stopped), stats(o.stats)
+                {
+                }
+
+                PathGeneratorState(PathGeneratorState &&) = default;
+
+                // used is a bitset over the cells.
+                bool is_used(unsigned i) const
+                {
+                        return used[i / 64] >> (i % 64) & 1;
+                }
+
+                void mark(unsigned i, bool on)
+                {
+                        if (on) {
+                                used[i / 64] |= uint64_t(1) << (i % 64);
+                        } else {
+                                used[i / 64] &= ~(uint64_t(1) << (i % 64));
+                        }
+                }
+        };
+
+        template <class Metric, class Cells>
+        PathGeneratorState<Metric> path_state(std::pmr::memory_resource *mem, const Cells &cur, unsigned units)
+        {
+                PathGeneratorState<Metric> s(mem);
+                s.cur.assign(cur.begin(), cur.end());
+                s.used.assign((field.cells() + 63) / 64, 0);
+                for (unsigned i : s.cur) {
+                        s.mark(i, true);
+                        extend(s.metric, i);
+                        s.key ^= zobrist.cell[i];
+                }
+                s.units = units;
+                s.rnd.seed(rnd());
+                s.best = s.cur;
+                s.best_metric = s.metric;
+                return s;
+        }
+
+        template <class Metric>
+        struct PlannedPath {
+                std::pmr::vector<unsigned> path;
+                Metric metric;
+                bool truncated = false;
+        };
+
+        // size is a hard cap on the path; depth, iterations, width and
+        // deadline are search budgets that anytime passes may raise.
+        struct PathLimits {
+                unsigned depth;
+                unsigned size       = std::numeric_limits<unsigned>::max();
+                unsigned iterations = std::numeric_limits<unsigned>::max();
+                unsigned width      = 0;
+                Deadline deadline   = {};
+        };
+
+        template <class Metric, class S>
+        void gen_path(PathGeneratorState<Metric> &state, const PathLimits &limits, const S &shape) const
+        {
+                ++state.iterations;
+                if (!state.stopped && (state.iterations & 255) == 0 && limits.deadline.expired()) {
+                        state.stopped = true;
+                }
+                if (state.metric < state.best_metric) {
+                        state.best = state.cur;
+                        state.best_metric = state.metric;
+                }
+                state.stats.depth = std::max(state.stats.depth, state.depth);
+                if (state.units == 0 || state.cur.size() >= limits.size) {
+                        return;
+                }
+                if (state.stopped || state.depth >= limits.depth || state.iterations > limits.iterations) {
+                        state.truncated = true;
+                        return;
+                }
+
+                // Paths over the same cells to the same last cell have the
+                // same metric, units and depth, so a state whose subtree
+                // was already searched with at least the depth left now
+                // has nothing new, in this pass or a later one.
+                const unsigned remaining = limits.depth - state.depth;
+                const uint64_t key = state.key ^ zobrist.head[state.cur.back()];
+                if (state.generation) {
+                        ++state.stats.probes;
+                        if (auto nodes = table->probe(key, state.generation, remaining)) {
+                                ++state.stats.hits;
+                                state.stats.saved += *nodes;
+                                return;
+                        }
+                }
+                const bool truncated = state.truncated;
+                const unsigned iterations = state.iterations;
+                state.truncated = false;
+
+                state.mark(state.cur.back(), true);
+                auto neighbors = shape.neighbors(state.cur.back());
+                std::shuffle(neighbors.begin(), neighbors.end(), state.rnd);
+                for (const auto &cand : neighbors) {
+                        auto c = capture_cost(cand);
+                        if (c && state.units > (unsigned) std::max(0, *c) && !state.is_used(cand)) {
+                                const Metric saved = state.metric;
+                                state.cur.push_back(cand);
+                                extend(state.metric, cand);
+                                state.units -= *c;
+                                state.key ^= zobrist.cell[cand];
+                                ++state.depth;
+                                gen_path(state, limits, shape);
+                                --state.depth;
+                                state.key ^= zobrist.cell[cand];
+                                state.units += *c;
+                                state.metric = saved;
+                                state.cur.pop_back();
+                        }
+                }
+                state.mark(state.cur.back(), false);
+                // The iteration budget and the deadline cut every node after
+                // the first they cut, so the subtree is whole if neither
+                // has; without a depth cut either, it is whole for any depth.
+                if (state.generation && !state.stopped && state.iterations <= limits.iterations) {
+                        table->store(key, state.generation, state.truncated ? remaining : TranspositionTable::unbounded,
+                                     state.iterations - iterations);
+                }
+                state.truncated |= truncated;
+        }
+
+        // BFS distance to our capital, Manhattan where it is unreachable.
+        unsigned capital_dist(unsigned i) const {
+                const auto &home = distances.home;
+                if (home.valid() && home.dist[i] != DistanceField::inf) {
+                        return home.dist[i];
+                }
+                auto it = capital.find(player_id);
+                return it == capital.end() ? 0 : field.dist(i, it->second.first);
+        }
+
+        unsigned my_units(unsigned i) const {
+                if (field.armed(i) && field.owner[i] == player_id) {
+                        return field.size[i];
+                }
+                return 0;
+        }
+
+        // What the army on i can expand by in one move: the units it can
+        // move times the number of neighbours not ours they can take, 0
+        // if none. Hidden land is priced by capture_cost as of the last
+        // change around i.
+        long long frontier_value(unsigned i) const
+        {
+                unsigned units = my_units(i);
+                if (units <= 1) {
+                        return 0;
+                }
+                unsigned takes = 0;
+                for (unsigned u : field.neighbors(i)) {
+                        auto c = capture_cost(u);
+                        if (c && my_units(u) == 0 && units - 1 > (unsigned) std::max(0, *c)) {
+                                ++takes;
+                        }
+                }
+                return (long long) (units - 1) * takes;
+        }
+
+        void refresh_frontier(unsigned i)
+        {
+                if (long long value = frontier_value(i)) {
+                        frontier.set(i, value);
+                } else {
+                        frontier.erase(i);
+                }
+        }
+
+        const std::vector<unsigned> &my_cells() const {
+                return mine.items;
+        }
+
+        struct PathCaptureMetric {
+                unsigned size;
+                unsigned dist_sum;
+
+                bool operator<(const PathCaptureMetric &other) const {
+                        return size > other.size || (size == other.size && dist_sum < other.dist_sum);
+                }
+        };
+
+        void extend(PathCaptureMetric &m, unsigned i) const {
+                m.size += !field.visible(i) || (field.armed(i) && field.owner[i] != player_id);
+                m.dist_sum += capital_dist(i);
+        }
+
+        // With --commit, greedy_path and collect_path are followed one step
+        // a turn while they hold, rather than searched again every turn. A
+        // path holds while its first cell is still our army and it can pay
+        // every remaining capture_cost, as gen_path required when planning
+        // it. Enemy land changing within two steps of the path may offer
+        // something better, so it does not hold then either.
+        bool path_holds(const std::vector<unsigned> &path) const
+        {
+                if (path.size() < 2 || my_units(path.front()) <= 1) {
+                        return false;
+                }
+                long long units = (long long) my_units(path.front()) - 1;
+                for (std::size_t j = 1; j < path.size(); ++j) {
+                        auto c = capture_cost(path[j]);
+                        if (!c || units <= std::max(0, *c)) {
+                                return false;
+                        }
+                        units -= *c;
+                }
+                for (unsigned i : field.changed) {
+                        if (!field.armed(i) || field.owner[i] == 0 || field.owner[i] == player_id) {
+                                continue;
+                        }
+                        for (unsigned j : path) {
+                                if (field.dist(i, j) <= 2) {
+                                        return false;
+                                }
+                        }
+                }
+                return true;
+        }
+
+        // Moves the army at path.front() to the next cell of path.
+        Turn follow(std::vector<unsigned> &path)
+        {
+                PROFILE_COUNT("commit.followed", 1);
+                unsigned cur = path.front();
+                path.erase(path.begin());
+                return Move{MoveType::All, field.pos(cur), field.pos(path.front())};
+        }
+
+        std::vector<unsigned> greedy_path;
+
+        Turn greedy_start()
+        {
+                if (greedy_path.size() < 2 && (turn_num < 400 && capital[player_id].second <= 10)) {
+                        return Skip{};
+                } else if (options.commit && path_holds(greedy_path)) {
+                        return follow(greedy_path);
+                } else {
+                        PathLimits limits{10};
+                        limits.iterations = 1000;
+
+                        std::pmr::vector<unsigned> starts(arena());
+                        std::optional<PlannedPath<PathCaptureMetric>> prev;
+                        if (greedy_path.empty() || my_units(greedy_path.front()) <= 1) {
+                                if (turn_num >= 400 && options.frontier && frontier.size() > 0) {
+                                        starts = {frontier.top(1, arena())[0]};
+                                } else if (turn_num >= 400) {
+                                        starts = {mine.items[rnd() % mine.size()]};
+                                } else {
+                                        starts = {capital[player_id].first};
+                                }
+                                if (options.threads > 1) {
+                                        add_starts(starts, mine_by_army.top(options.threads, [&](unsigned i) {
+                                                return field.size[i];
+                                        }, arena()));
+                                }
+                        } else {
+                                starts = {greedy_path.front()};
+
+                                {
+                                        unsigned units = my_units(greedy_path.back()) - 1;
+                                        auto s = path_state<PathCaptureMetric>(arena(), greedy_path, units);
+                                        prev = plan_path(s, limits, deadline.share(0.5));
+                                        stats.merge(s.stats);
+                                }
+                        }
+
+                        auto next = plan_from<PathCaptureMetric>(starts, limits, deadline);
+
+                        if (prev && prev->path.size() >= 2 && prev->metric < next.metric) {
+                                next = std::move(*prev);
+                        }
+                        greedy_path.assign(next.path.begin(), next.path.end());
+
+                        if (greedy_path.size() < 2) {
+                                throw std::logic_error("Failed to build path");
+                        }
+                        unsigned cur = greedy_path.front();
+                        greedy_path.erase(greedy_path.begin());
+                        
+                        auto c = capture_cost(greedy_path.front());
+                        if (c && (unsigned) std::max(*c, 0) > my_units(cur)) {
+                                throw std::logic_error("Tried to capture city");
+                        }
+
+                        return Move{MoveType::All, field.pos(cur), field.pos(greedy_path.front())};
+                }
+        }
+
+        struct PathCollectMetric {
+                int collected;
+                int dist;
+
+                bool operator<(const PathCollectMetric &other) const {
+                        return collected > other.collected || (collected == other.collected && dist < other.dist);
+                }
+        };
+
+        void extend(PathCollectMetric &m, unsigned i) const {
+                m.collected -= *capture_cost(i);
+                m.dist = capital_dist(i);
+        }
+
+
+        struct BeamNode {
+                unsigned cell;
+                unsigned parent;
+                unsigned units;
+        };
+
+        // Deterministic alternative to gen_path: keeps the options.beam_width
+        // best extensions of s.cur per depth and returns the best path seen.
+        // At most width * 4 nodes are created per depth.
+        template <class Metric, class S>
+        PlannedPath<Metric> beam_path(PathGeneratorState<Metric> &s, const PathLimits &limits, const S &shape) const
+        {
+                constexpr unsigned none = std::numeric_limits<unsigned>::max();
+                const unsigned width    = std::max(1u, limits.width ? limits.width : options.beam_width);
+                bool truncated          = false;
+
+                auto *mem = s.cur.get_allocator().resource();
+                std::pmr::vector<BeamNode> nodes(mem);
+                std::pmr::vector<Metric> metrics(mem);
+                std::pmr::vector<uint64_t> keys(mem);
+                nodes.reserve(std::min(s.cur.size() + 4 * width * std::min(limits.depth, 32u), std::size_t(1) << 16));
+                metrics.reserve(nodes.capacity());
+                keys.reserve(nodes.capacity());
+
+                Metric m{};
+                uint64_t key = 0;
+                for (unsigned i : s.cur) {
+                        extend(m, i);
+                        key ^= zobrist.cell[i];
+                        nodes.push_back({i, nodes.empty() ? none : (unsigned) nodes.size() - 1, 0});
+                        metrics.push_back(m);
+                        keys.push_back(key);
+                }
+                nodes.back().units = s.units;
+
+                auto on_path = [&](unsigned v, unsigned cell) {
+                        for (; v != none; v = nodes[v].parent) {
+                                if (nodes[v].cell == cell) {
+                                        return true;
+                                }
+                        }
+                        return false;
+                };
+
+                unsigned best = nodes.size() - 1;
+                std::pmr::vector<unsigned> layer(1, best, mem), next(mem);
+                unsigned depth = 0;
+                for (; depth < limits.depth && s.cur.size() + depth < limits.size && !layer.empty(); ++depth) {
+                        if (depth > 0 && limits.deadline.expired()) {
+                                truncated = true;
+                                break;
+                        }
+                        next.clear();
+                        for (unsigned v : layer) {
+                                if (depth > 0 && (v & 63) == 0 && limits.deadline.expired()) {
+                                        truncated = true;
+                                        next.clear();
+                                        break;
+                                }
+                                if (nodes[v].units == 0) {
+                                        continue;
+                                }
+                                for (unsigned u : shape.neighbors(nodes[v].cell)) {
+                                        auto c = capture_cost(u);
+                                        if (!c || nodes[v].units <= (unsigned) std::max(0, *c) || on_path(v, u)) {
+                                                continue;
+                                        }
+                                        Metric mu = metrics[v];
+                                        extend(mu, u);
+                                        nodes.push_back({u, v, nodes[v].units - *c});
+                                        metrics.push_back(mu);
+                                        keys.push_back(keys[v] ^ zobrist.cell[u]);
+                                        next.push_back(nodes.size() - 1);
+                                }
+                        }
+                        if (truncated && next.empty()) {
+                                break;
+                        }
+                        // Orders of the same cells ending in the same cell
+                        // are one state: keep the first, so the beam holds
+                        // width distinct states.
+                        auto state_key = [&](unsigned v) {
+                                return keys[v] ^ zobrist.head[nodes[v].cell];
+                        };
+                        std::sort(next.begin(), next.end(), [&](unsigned a, unsigned b) {
+                                return std::make_pair(state_key(a), a) < std::make_pair(state_key(b), b);
+                        });
+                        const std::size_t generated = next.size();
+                        next.erase(std::unique(next.begin(), next.end(), [&](unsigned a, unsigned b) {
+                                return state_key(a) == state_key(b);
+                        }), next.end());
+                        s.stats.probes += generated;
+                        s.stats.hits += generated - next.size();
+                        // Ties keep creation order, as a stable sort would.
+                        auto better = [&](unsigned a, unsigned b) {
+                                return metrics[a] < metrics[b] || (!(metrics[b] < metrics[a]) && a < b);
+                        };
+                        if (next.size() > width) {
+                                std::nth_element(next.begin(), next.begin() + width, next.end(), better);
+                                next.resize(width);
+                                truncated = true;
+                        }
+                        std::sort(next.begin(), next.end(), better);
+                        if (!next.empty() && metrics[next.front()] < metrics[best]) {
+                                best = next.front();
+                        }
+                        std::swap(layer, next);
+                }
+                if (depth == limits.depth && !layer.empty()) {
+                        truncated = true;
+                }
+                s.stats.nodes += nodes.size() - s.cur.size();
+                s.stats.depth = std::max(s.stats.depth, depth);
+                PROFILE_COUNT("beam_path.nodes", nodes.size() - s.cur.size());
+                PROFILE_COUNT("beam_path.duplicates", s.stats.hits);
+
+                PlannedPath<Metric> res{std::pmr::vector<unsigned>(mem), metrics[best], truncated};
+                for (unsigned v = best; v != none; v = nodes[v].parent) {
+                        res.path.push_back(nodes[v].cell);
+                }
+                std::reverse(res.path.begin(), res.path.end());
+                return res;
+        }
+
+        template <class Metric>
+        PlannedPath<Metric> plan_once(PathGeneratorState<Metric> &s, const PathLimits &limits) const
+        {
+                PROFILE_SCOPE("plan_once");
+                ++s.stats.passes;
+                return with_shape(field.size_x, field.size_y, [&](const auto &shape) -> PlannedPath<Metric> {
+                        if (options.planner == Planner::Beam) {
+                                return beam_path(s, limits, shape);
+                        }
+                        gen_path(s, limits, shape);
+                        s.stats.nodes += s.iterations;
+                        PROFILE_COUNT("gen_path.iterations", s.iterations);
+                        PROFILE_COUNT("gen_path.tt_hits", s.stats.hits);
+                        PROFILE_COUNT("gen_path.tt_saved", s.stats.saved);
+                        return {std::move(s.best), s.best_metric, s.truncated};
+                });
+        }
+
+        // Anytime planning: a first pass under the fixed limits, then, while
+        // the deadline allows, passes with growing depth, iteration and
+        // width budgets, keeping the best result so far. Every pass stops at
+        // the deadline with the best path it has seen; the first one always
+        // gets past the start cell. Stops early once a pass was not cut
+        // short by its budget.
+        template <class Metric>
+        PlannedPath<Metric> plan_path(PathGeneratorState<Metric> &s, PathLimits limits, const Deadline &until = {}) const
+        {
+                if (table) {
+                        s.generation = table->begin();
+                }
+                if (!until.enabled()) {
+                        limits.deadline = until;
+                        return plan_once(s, limits);
+                }
+                const auto initial = s;
+                limits.deadline = until;
+                auto best = plan_once(s, limits);
+                bool truncated = best.truncated;
+                limits.width = std::max(1u, options.beam_width);
+                while (truncated && limits.depth < field.cells() && !until.expired()) {
+                        limits.depth += limits.depth / 2 + 1;
+                        limits.width *= 2;
+                        if (limits.iterations != std::numeric_limits<unsigned>::max()) {
+                                limits.iterations = std::min(limits.iterations, std::numeric_limits<unsigned>::max() / 4) * 4;
+                        }
+                        auto t = initial;
+                        auto next = plan_once(t, limits);
+                        s.stats.merge(t.stats);
+                        truncated = next.truncated;
+                        if (next.metric < best.metric) {
+                                best = std::move(next);
+                        }
+                }
+                PROFILE_COUNT("plan_path.passes", s.stats.passes);
+                return best;
+        }
+
+        // Fills starts up to --threads cells from candidates, best first.
+        void add_starts(std::pmr::vector<unsigned> &starts, const std::pmr::vector<unsigned> &candidates) const
+        {
+                for (unsigned i : candidates) {
+                        if (starts.size() >= options.threads) {
+                                break;
+                        }
+                        if (std::find(starts.begin(), starts.end(), i) == starts.end() && my_units(i) > 1) {
+                                starts.push_back(i);
+                        }
+                }
+        }
+
+        // Plans a path from each start, in parallel on the pool if there is
+        // one. Every search gets its own state and rng, seeded from rnd in
+        // start order, and ties go to the earlier start, so the result only
+        // depends on the seed and the starts.
+        template <class Metric>
+        PlannedPath<Metric> plan_from(const std::pmr::vector<unsigned> &starts, const PathLimits &limits, const Deadline &until)
+        {
+                std::pmr::vector<PathGeneratorState<Metric>> states(arena());
+                states.reserve(starts.size());
+                for (std::size_t j = 0; j < starts.size(); ++j) {
+                        states.push_back(path_state<Metric>(arena(j), std::array<unsigned, 1>{starts[j]}, my_units(starts[j]) - 1));
+                }
+                std::pmr::vector<std::optional<PlannedPath<Metric>>> plans(states.size(), arena());
+                auto plan = [&](unsigned j) {
+                        plans[j] = plan_path(states[j], limits, until);
+                };
+                if (pool && states.size() > 1) {
+                        pool->run(states.size(), std::ref(plan));
+                } else {
+                        for (unsigned j = 0; j < states.size(); ++j) {
+                                plan(j);
+                        }
+                }
+
+                unsigned best = 0;
+                for (unsigned j = 0; j < states.size(); ++j) {
+                        stats.merge(states[j].stats);
+                        if (plans[j]->metric < plans[best]->metric) {
+                                best = j;
+                        }
+                }
+                return std::move(*plans[best]);
+        }
+
+        std::vector<unsigned> collect_path;
+        unsigned collected_len = 0;
+
+        // With --attack=mcts, checks trahat's move src -> dest once an enemy
+        // army is in the Skirmish window around src: UCB1 over it and the
+        // moves of our largest armies in the window, each sample a rollout
+        // of `horizon` turns on a copy of the snapshot. The enemy answers
+        // every move, then both sides follow Skirmish::policy. A rollout
+        // scores 1 for taking the enemy capital, 0 for losing ours, else
+        // its score gain squashed into (0, 1). Returns the best move as
+        // field indices if it beats src -> dest by `margin`, else nullopt:
+        // the rollouts only see the window, trahat knows where to go.
+        std::optional<std::pair<unsigned, unsigned>> attack_search(unsigned src, unsigned dest)
+        {
+                PROFILE_SCOPE("attack_search");
+                constexpr unsigned horizon = 8, rollouts = 1024;
+                constexpr double scale = 10, margin = 0.05;
+
+                Skirmish::Terrain terrain;
+                terrain.w = std::min(Skirmish::span, field.size_x);
+                terrain.h = std::min(Skirmish::span, field.size_y);
+                Skirmish root;
+                root.terrain = &terrain;
+                root.turn    = turn_num;
+                auto [sx, sy] = field.pos(src);
+                const unsigned x0 = std::clamp<int>((int) sx - (int) Skirmish::span / 2, 0, field.size_x - terrain.w);
+                const unsigned y0 = std::clamp<int>((int) sy - (int) Skirmish::span / 2, 0, field.size_y - terrain.h);
+                auto at = [&](unsigned j) {
+                        return (y0 + j / terrain.w) * field.size_x + x0 + j % terrain.w;
+                };
+
+                // The enemy we fight owns the armed cell nearest to src.
+                unsigned foe = 0, foe_dist = std::numeric_limits<unsigned>::max();
+                for (unsigned j = 0; j < root.cells(); ++j) {
+                        unsigned i = at(j);
+                        if (field.armed(i) && field.owner[i] != 0 && field.owner[i] != player_id && field.dist(i, src) < foe_dist) {
+                                foe      = field.owner[i];
+                                foe_dist = field.dist(i, src);
+                        }
+                }
+                if (!foe) {
+                        return std::nullopt;
+                }
+                for (unsigned j = 0; j < root.cells(); ++j) {
+                        unsigned i = at(j);
+                        terrain.flags[j] = (field.passable(i) ? 0 : Skirmish::Blocked) |
+                                           (field.kind[i] & (CellKind::City | CellKind::Capital) ? Skirmish::Grows : 0) |
+                                           (field.kind[i] & CellKind::Capital ? Skirmish::Capital : 0);
+                        if (field.armed(i)) {
+                                root.side[j] = field.owner[i] == player_id ? 1 : field.owner[i] == foe ? 2 : 0;
+                                root.army[j] = field.size[i];
+                        }
+                }
+                terrain.finish();
+
+                struct Arm {
+                        unsigned from, to;
+                        unsigned samples = 0;
+                        double reward    = 0;
+                };
+                auto [dx, dy] = field.pos(dest);
+                std::pmr::vector<Arm> arms(1, {sx - x0 + (sy - y0) * terrain.w, dx - x0 + (dy - y0) * terrain.w}, arena());
+                unsigned from[Skirmish::armies];
+                unsigned n = root.largest(1, from);
+                for (unsigned k = 0; k < n; ++k) {
+                        for (unsigned u : root.neighbors(from[k])) {
+                                if (from[k] != arms[0].from || u != arms[0].to) {
+                                        arms.push_back({from[k], u});
+                                }
+                        }
+                }
+                if (arms.size() == 1) {
+                        return std::nullopt;
+                }
+
+                // xorshift64: rollouts draw a few random numbers per move.
+                uint64_t seed = rnd() | 1;
+                auto random = [&] {
+                        seed ^= seed << 13;
+                        seed ^= seed >> 7;
+                        seed ^= seed << 17;
+                        return seed;
+                };
+                const long long base = root.score();
+                unsigned total = 0;
+                for (; total < rollouts; ++total) {
+                        if ((total & 63) == 0 && total > 0 && deadline.expired()) {
+                                break;
+                        }
+                        Arm *arm = nullptr;
+                        double best = -1;
+                        for (auto &a : arms) {
+                                double ucb = a.samples == 0 ? 2 : a.reward / a.samples + std::sqrt(2 * std::log(total + 1.0) / a.samples);
+                                if (ucb > best) {
+                                        best = ucb;
+                                        arm  = &a;
+                                }
+                        }
+
+                        Skirmish s = root;
+                        s.move(1, arm->from, arm->to);
+                        for (unsigned d = 0; d < horizon && !s.lost; ++d) {
+                                if (d > 0) {
+                                        auto [from, to] = s.policy(1, random);
+                                        s.move(1, from, to);
+                                }
+                                auto [from, to] = s.policy(2, random);
+                                s.move(2, from, to);
+                                s.end_turn();
+                        }
+                        double reward = s.lost == 2 ? 1 : s.lost == 1 ? 0 : 1 / (1 + std::exp((base - s.score()) / scale));
+                        ++arm->samples;
+                        arm->reward += reward;
+                }
+                PROFILE_COUNT("attack_search.rollouts", total);
+
+                auto mean = [](const Arm &a) {
+                        return a.samples ? a.reward / a.samples : 0;
+                };
+                const Arm *pick = &arms[0];
+                for (const auto &a : arms) {
+                        if (a.samples > pick->samples) {
+                                pick = &a;
+                        }
+                }
+                if (pick == &arms[0] || mean(*pick) < mean(arms[0]) + margin) {
+                        return std::nullopt;
+                }
+                return std::make_pair(at(pick->from), at(pick->to));
+        }
+
+        Turn trahat() {
+                PROFILE_SCOPE("trahat");
+                // Nothing gathered yet (collect_len is 1 on small boards):
+                // attack with the largest army.
+                if (collect_path.empty()) {
+                        if (mine.size() == 0) {
+                                return Skip{};
+                        }
+                        collect_path = {mine_by_army.top(1, [&](unsigned i) {
+                                return field.size[i];
+                        }, arena())[0]};
+                }
+                unsigned src = collect_path.front();
+                if (my_units(src) == 0) {
+                        collected_len = 0;
+                        collect_path.clear();
+                }
+
+                // A reachable enemy capital wins. By default one CostField
+                // pass from src prices it and every other target by the
+                // army it takes to get there; with --route=steps, the
+                // capital's cached field leads there by BFS steps.
+                const DistanceField *route = nullptr;
+                for (const auto &[id, cap] : capital) {
+                        if (id == player_id || options.route == Route::Army) {
+                                continue;
+                        }
+                        const auto &f = distances.capital(field, id, cap.first, false);
+                        if (f.dist[src] != DistanceField::inf && f.dist[src] > 0 && (!route || f.dist[src] < route->dist[src])) {
+                                route = &f;
+                        }
+                }
+
+                std::optional<unsigned> nearest;
+                if (route) {
+                        nearest = route->source;
+                } else {
+                        const bool army = options.route == Route::Army;
+                        if (army) {
+                                PROFILE_SCOPE("trahat.costs");
+                                costs.run(field, src, (long long) my_units(src) - 1, std::max(1u, my_units(src)), [&](unsigned i) {
+                                        return capture_cost(i);
+                                });
+                        } else {
+                                route = &distances.from(field, src);
+                        }
+                        const auto &dist = army ? costs.dist : route->dist;
+                        // Nearest first; by army, targets the army reaches
+                        // alive before cheaper ones.
+                        auto key = [&](unsigned i) {
+                                return std::make_tuple(army && costs.left[i] <= 0, dist[i], i);
+                        };
+                        auto consider = [&](unsigned i) {
+                                if (dist[i] != DistanceField::inf && (!nearest || key(i) < key(*nearest))) {
+                                        nearest = i;
+                                }
+                        };
+                        if (army) {
+                                for (const auto &[id, cap] : capital) {
+                                        if (id != player_id && cap.first != src) {
+                                                consider(cap.first);
+                                        }
+                                }
+                        }
+                        // With --belief, head for the likely capital of an
+                        // enemy whose capital we have not seen, once we saw
+                        // half its land: earlier guesses are too far off.
+                        if (!nearest && options.belief) {
+                                for (unsigned p = 1; p <= player_count; ++p) {
+                                        if (p == player_id || capital.count(p) || belief.territory[p].cells * 2 < info[p].land) {
+                                                continue;
+                                        }
+                                        if (auto guess = likely_capital(p)) {
+                                                consider(*guess);
+                                        }
+                                }
+                        }
+                        if (!nearest && exists_not_me) {
+                                for (unsigned i : enemy) {
+                                        consider(i);
+                                }
+                        } else if (!nearest) {
+                                unsigned i = nearest_foreign(dist.data(), field.owner.data(), field.kind.data(), field.cells(), player_id);
+                                if (i != DistanceField::inf) {
+                                        nearest = i;
+                                }
+                        }
+                }
+
+                if (!nearest) {
+                        collected_len = 0;
+                        collect_path.clear();
+                        return Skip{};
+                }
+
+                // Descend the distance gradient; from a capital's field the
+                // first step out of src, from src's field the last step back.
+                auto step = [&](unsigned v) {
+                        for (unsigned u : field.neighbors(v)) {
+                                if (field.passable(u) && route->dist[u] + 1 == route->dist[v]) {
+                                        return u;
+                                }
+                        }
+                        return v;
+                };
+                unsigned cur_pos;
+                if (!route) {
+                        cur_pos = *nearest;
+                        while (cur_pos != src && costs.prev[cur_pos] != src) {
+                                cur_pos = costs.prev[cur_pos];
+                        }
+                } else if (route->source == *nearest) {
+                        cur_pos = step(src);
+                } else {
+                        cur_pos = *nearest;
+                        while (route->dist[cur_pos] > 1) {
+                                cur_pos = step(cur_pos);
+                        }
+                }
+                if (options.attack == Attack::Mcts) {
+                        if (auto move = attack_search(src, cur_pos)) {
+                                auto [from, to] = *move;
+                                if (from == src) {
+                                        collect_path = {to};
+                                }
+                                return Move{MoveType::All, field.pos(from), field.pos(to)};
+                        }
+                }
+                collect_path = {cur_pos};
+                return Move{MoveType::All, field.pos(src), field.pos(cur_pos)};
+        }
+
+        // trahat's army-weighted routes, unless --route=steps.
+        CostField costs;
+
+        // Queued moves of the current gather tree as (src, dest), the next
+        // one at the back.
+        std::vector<std::pair<unsigned, unsigned>> gather_moves;
+
+        // Plans the gather tree of at most `budget` moves that brings the
+        // most units into target over our own cells, fewest moves on ties.
+        // Tree knapsack over the BFS tree rooted at target, laid out in DFS
+        // preorder: f[i][j] is the most units cells i.. of the order can
+        // send up with exactly j moves, where skipping a cell skips its
+        // subtree. O(cells * budget) time and memory, in the turn arena.
+        void plan_gather(unsigned target, unsigned budget)
+        {
+                constexpr unsigned none = std::numeric_limits<unsigned>::max();
+                constexpr long long lost = std::numeric_limits<long long>::min() / 2;
+                auto *mem = arena();
+
+                std::pmr::vector<unsigned> id(field.cells(), none, mem);
+                std::pmr::vector<unsigned> cell(1, target, mem), parent(1, none, mem), depth(1, 0, mem);
+                id[target] = 0;
+                for (std::size_t h = 0; h < cell.size(); ++h) {
+                        if (depth[h] == budget) {
+                                continue;
+                        }
+                        for (unsigned u : field.neighbors(cell[h])) {
+                                if (id[u] == none && my_units(u) > 0) {
+                                        id[u] = cell.size();
+                                        cell.push_back(u);
+                                        parent.push_back(h);
+                                        depth.push_back(depth[h] + 1);
+                                }
+                        }
+                }
+                const unsigned n = cell.size();
+
+                // Children in BFS order, then preorder and subtree sizes.
+                std::pmr::vector<unsigned> first(n + 1, 0, mem), children(n, mem);
+                for (unsigned v = 1; v < n; ++v) {
+                        ++first[parent[v] + 1];
+                }
+                std::partial_sum(first.begin(), first.end(), first.begin());
+                {
+                        std::pmr::vector<unsigned> fill(first.begin(), first.end() - 1, mem);
+                        for (unsigned v = 1; v < n; ++v) {
+                                children[fill[parent[v]]++] = v;
+                        }
+                }
+                std::pmr::vector<unsigned> pre(mem), stack(1, 0, mem), subtree(n, 1, mem);
+                pre.reserve(n);
+                while (!stack.empty()) {
+                        unsigned v = stack.back();
+                        stack.pop_back();
+                        pre.push_back(v);
+                        for (unsigned c = first[v + 1]; c-- > first[v];) {
+                                stack.push_back(children[c]);
+                        }
+                }
+                for (unsigned i = n; i-- > 1;) {
+                        subtree[parent[pre[i]]] += subtree[pre[i]];
+                }
+
+                const unsigned width = budget + 1;
+                std::pmr::vector<long long> f((std::size_t) (n + 1) * width, lost, mem);
+                f[(std::size_t) n * width] = 0;
+                for (unsigned i = n; i-- > 1;) {
+                        unsigned v = pre[i];
+                        long long w = (long long) field.size[cell[v]] - 1;
+                        const long long *skip = &f[(std::size_t) (i + subtree[v]) * width];
+                        const long long *take = &f[(std::size_t) (i + 1) * width];
+                        long long *row = &f[(std::size_t) i * width];
+                        for (unsigned j = 0; j < width; ++j) {
+                                row[j] = skip[j];
+                                if (j > 0 && take[j - 1] != lost) {
+                                        row[j] = std::max(row[j], w + take[j - 1]);
+                                }
+                        }
+                }
+
+                gather_moves.clear();
+                if (n < 2) {
+                        return;
+                }
+                unsigned moves = 0;
+                for (unsigned j = 1; j < width; ++j) {
+                        if (f[width + j] > f[width + moves]) {
+                                moves = j;
+                        }
+                }
+                std::pmr::vector<unsigned> taken(mem);
+                for (unsigned i = 1, j = moves; i < n && j > 0;) {
+                        unsigned v = pre[i];
+                        long long w = (long long) field.size[cell[v]] - 1;
+                        const long long take = f[(std::size_t) (i + 1) * width + j - 1];
+                        if (take != lost && f[(std::size_t) i * width + j] == w + take) {
+                                taken.push_back(v);
+                                ++i;
+                                --j;
+                        } else {
+                                i += subtree[v];
+                        }
+                }
+                // Children are one level deeper than their parent, so the
+                // deepest cells move first; the back of the queue goes first.
+                // Sorted stably by (depth, position): stable_sort would take
+                // its buffer from the heap.
+                std::pmr::vector<std::pair<unsigned, unsigned>> order(mem);
+                order.reserve(taken.size());
+                for (unsigned j = 0; j < taken.size(); ++j) {
+                        order.push_back({depth[taken[j]], j});
+                }
+                std::sort(order.begin(), order.end());
+                for (const auto &o : order) {
+                        unsigned v = taken[o.second];
+                        gather_moves.push_back({cell[v], cell[parent[v]]});
+                }
+        }
+
+        // Midgame with --gather=tree: gathers into our largest army along
+        // an optimal tree, then attacks with it through trahat until it is
+        // spent, then plans the next tree.
+        Turn gather_tree(unsigned collect_len)
+        {
+                if (gather_moves.empty() && (collect_path.empty() || my_units(collect_path.front()) <= 1)) {
+                        if (mine.size() == 0) {
+                                return Skip{};
+                        }
+                        unsigned target = mine_by_army.top(1, [&](unsigned i) {
+                                return field.size[i];
+                        }, arena())[0];
+                        plan_gather(target, collect_len);
+                        collect_path = {target};
+                }
+                while (!gather_moves.empty()) {
+                        auto [src, dest] = gather_moves.back();
+                        gather_moves.pop_back();
+                        if (my_units(src) > 1 && field.passable(dest)) {
+                                return Move{MoveType::All, field.pos(src), field.pos(dest)};
+                        }
+                }
+                return trahat();
+        }
+
+        Turn midgame() {
+                unsigned collect_len = std::min(mine.size() / 2, field.size_x * field.size_y / 40);
+                if (options.gather == Gather::Tree) {
+                        return gather_tree(collect_len);
+                }
+                if (collected_len + 1 == collect_len) {
+                        return trahat();
+                } else if (options.commit && collected_len < collect_len &&
+                           collect_path.size() <= collect_len - collected_len && path_holds(collect_path)) {
+                        ++collected_len;
+                        return follow(collect_path);
+                } else {
+                        PathLimits limits{10};
+                        limits.size = collect_len - collected_len;
+
+                        std::pmr::vector<unsigned> starts(arena());
+                        std::optional<PlannedPath<PathCollectMetric>> prev;
+                        if (collect_path.empty() || my_units(collect_path.front()) == 0) {
+                                collected_len = 0;
+                                // With --frontier, from the armies that can
+                                // expand most rather than the largest ones.
+                                auto cells = options.frontier && frontier.size() > 0
+                                                 ? frontier.top(std::max(30u, options.threads), arena())
+                                                 : mine_by_army.top(std::max(30u, options.threads), [&](unsigned i) {
+                                                           return field.size[i];
+                                                   }, arena());
+                                starts = {cells[rnd() % std::min<std::size_t>(30, cells.size())]};
+                                add_starts(starts, cells);
+                        } else {
+                                starts = {collect_path.front()};
+
+                                {
+                                        auto s = path_state<PathCollectMetric>(arena(), collect_path, 0);
+                                        s.units = std::max(0, s.metric.collected);
+                                        prev = plan_path(s, limits, deadline.share(0.5));
+                                        stats.merge(s.stats);
                                 }
+                        }
+
+                        auto next = plan_from<PathCollectMetric>(starts, limits, deadline);
+
+                        if (prev && prev->path.size() >= 2 && prev->metric < next.metric) {
+                                next = std::move(*prev);
+                        }
+                        collect_path.assign(next.path.begin(), next.path.end());
+
+                        if (collect_path.size() < 2) {
+                                collect_path.clear();
+                                collected_len = 0;
+                                throw std::logic_error("Failed to build path");
+                        }
+
+                        unsigned cur = collect_path.front();
+                        ++collected_len;
+                        collect_path.erase(collect_path.begin());
+                        
+                        auto c = capture_cost(collect_path.front());
+                        if (c && (unsigned) std::max(*c, 0) > my_units(cur)) {
+                                throw std::logic_error("Tried to capture uncapturable");
+                        }
+
+                        return Move{MoveType::All, field.pos(cur), field.pos(collect_path.front())};
+                }
+                return Skip{};
+        }
+
+        void check(const Turn &a) const
+        {
+                if (std::holds_alternative<Skip>(a)) {
+                        return;
+                } else if (std::holds_alternative<Move>(a)) {
+                        const auto &[type, from, to] = std::get<Move>(a);
+                        unsigned src = field.index(from), dest = field.index(to);
+                        if (my_units(src) == 0) {
+                                throw std::logic_error("Invalid turn: no units in source");
+                        }
+                        if (field.dist(src, dest) != 1) {
+                                throw std::logic_error("Invalid turn: sources does not neighbor destination");
+                        }
+                        if (!field.armed(dest)) {
+                                throw std::logic_error("Invalid turn: unarmed destination");
+                        }
+                } else {
+                        throw std::logic_error("Invalid turn: empty turn");
+                }
+        }
+
+        
+        Turn do_turn(const Deadline &until = {})
+        {
+                PROFILE_SCOPE("do_turn");
+                deadline = until;
+                stats    = {};
+                if (field.size_x * field.size_y <= 50 && (turn_num <= 2 * field.size_x * field.size_y && !exists_not_me)) {
+                        return greedy_start();
+                } else {
+                        return midgame();
+                }
+        }
+};
+
+// Plans the next turn on a copy of the state advanced by State::predict,
+// on a worker thread, while the judge computes the real next state. The
+// worker only writes the copy's search state, so matches() may compare
+// the copy's field concurrently.
+struct Speculation {
+        State state;
+        std::atomic<bool> cancel{false};
+        Turn turn = Skip{};
+        std::string error;
+        std::thread worker;
+
+        Speculation(const State &current, const Turn &made, unsigned time_ms)
+            : state(current)
+        {
+                state.predict(made);
+                worker = std::thread([this, time_ms, profile = profile_current()] {
+                        ProfileGameScope scope(profile);
+                        Deadline until;
+                        if (time_ms) {
+                                until = Deadline::after(std::chrono::milliseconds(time_ms));
+                        }
+                        until.cancel = &cancel;
+                        try {
+                                turn = state.do_turn(until);
+                                state.check(turn);
+                        } catch (std::exception &e) {
+                                error = e.what();
+                        }
+                });
+        }
+
+        ~Speculation()
+        {
+                cancel = true;
+                if (worker.joinable()) {
+                        worker.join();
+                }
+        }
+
+        bool matches(const State &actual) const
+        {
+                return state.turn_num == actual.turn_num && state.field.kind == actual.field.kind
+                    && state.field.owner == actual.field.owner && state.field.size == actual.field.size;
+        }
+
+        // Waits for the worker and hands over its state; only valid after
+        // matches(), when planning from scratch would have done the same.
+        State finish(const State &actual)
+        {
+                worker.join();
+                state.info = actual.info;
+                return std::move(state);
+        }
+};
+
+// Plays one game: the header from `in` in start(), then a turn per
+// step() until the judge sends 0. Reads only from `in` and writes only
+// to `out`, so a game can run over any stream, or as a session of
+// serve() that is fed turn by turn.
+template <class Input>
+struct Interactor {
+        Input &in;
+        TurnWriter &out;
+        Options options;
+
+        std::optional<State> state;
+        std::unique_ptr<Speculation> ahead;
+        unsigned hits = 0, misses = 0;
+        std::optional<ReplayWriter> recorder;
+
+        Interactor(Input &_in, TurnWriter &_out, const Options &_options) : in(_in), out(_out), options(_options)
+        {
+        }
+
+        void run()
+        {
+                start();
+                while (step()) {
+                }
+                finish();
+                profile_report(options.profile_json);
+        }
+
+        void start()
+        {
+                unsigned n, m, k, id;
+                in >> n >> m >> k >> id;
+
+                state.emplace(m, n, k, id, options);
+                if (!options.record.empty()) {
+                        recorder.emplace(options.record);
+                        recorder->header(n, m, k, id);
+                }
+        }
+
+        // Plays the next turn, timing --time-ms from `received`, or from
+        // when the turn's first number was read if it is not given; false
+        // once the game is over.
+        bool step(std::optional<Deadline::clock::time_point> received = std::nullopt)
+        {
+                int is_ok;
+                in >> is_ok;
+                if (!is_ok) {
+                        return false;
+                }
+                Deadline deadline;
+                if (options.time_ms) {
+                        deadline = {received.value_or(Deadline::clock::now()) + std::chrono::milliseconds(options.time_ms)};
+                }
+                state->read_next(in);
+                if (recorder) {
+                        recorder->input(state->info, state->field);
+                }
+                Turn turn = Skip{};
+                if (ahead && ahead->matches(*state)) {
+                        ++hits;
+                        *state = ahead->finish(*state);
+                        if (ahead->error.empty()) {
+                                turn = ahead->turn;
                         } else {
-                                begin = greedy_path.front();
+                                std::cerr << ahead->error << "\n";
+                        }
+                } else {
+                        misses += ahead != nullptr;
+                        ahead.reset();
+                        try {
+                                turn = state->do_turn(deadline);
+                                state->check(turn);
+                        } catch (std::exception &e) {
+                                std::cerr << e.what() << "\n";
+                                turn = Skip{};
+                        }
+                }
+                if (!out.put(turn)) {
+                        throw std::runtime_error("Cannot write the answer");
+                }
+                if (recorder) {
+                        recorder->answer(turn);
+                }
+                if (options.time_ms) {
+                        const auto &s = state->stats;
+                        std::cerr << "turn " << state->turn_num << ": depth " << s.depth << " nodes " << s.nodes
+                                  << " passes " << s.passes;
+                        if (s.probes) {
+                                std::cerr << " tt hits " << s.hits << "/" << s.probes << " saved " << s.saved;
+                        }
+                        std::cerr << "\n";
+                }
+                if (options.speculate) {
+                        ahead = std::make_unique<Speculation>(*state, turn, options.time_ms);
+                }
+                return true;
+        }
+
+        void finish()
+        {
+                if (options.speculate) {
+                        std::cerr << "speculation: " << hits << " hits, " << misses << " misses\n";
+                }
+                ahead.reset();
+        }
+};
+
+// Whether [p, end) holds a whole message: the header, or a turn of a game
+// with k players on `cells` cells. A number counts once a separator
+// follows it; anything else counts as whole, for the parser to reject.
+bool whole_message(const char *p, const char *end, bool header, unsigned k, unsigned cells)
+{
+        bool bad = false;
+        auto next = [&](unsigned &v) {
+                while (p != end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) {
+                        ++p;
+                }
+                if (p != end && (*p < '0' || *p > '9')) {
+                        bad = true;
+                        return false;
+                }
+                for (v = 0; p != end && *p >= '0' && *p <= '9'; ++p) {
+                        v = v * 10 + (*p - '0');
+                }
+                return p != end;
+        };
+        unsigned v, visible, t;
+        if (header) {
+                for (unsigned i = 0; i < 4; ++i) {
+                        if (!next(v)) {
+                                return bad;
+                        }
+                }
+                return true;
+        }
+        if (!next(v)) {
+                return bad;
+        }
+        if (v == 0) {
+                return true;
+        }
+        for (unsigned i = 0; i < 2 * k; ++i) {
+                if (!next(v)) {
+                        return bad;
+                }
+        }
+        for (unsigned i = 0; i < cells; ++i) {
+                if (!next(visible) || !next(t) || (visible && t >= 1 && t <= 3 && (!next(v) || !next(v)))) {
+                        return bad;
+                }
+        }
+        return true;
+}
+
+// A game served over a connection: what arrived of it and the Interactor
+// that plays it from there.
+struct Session {
+        int fd;
+        FdReader in{-1, 1 << 12};
+        TurnWriter out;
+        Interactor<FdReader> game;
+        bool started = false;
+        bool over    = false;
+        Deadline::clock::time_point received;
+        unsigned id;
+        ProfileGame profile;
+
+        Session(int _fd, unsigned _id, const Options &options) : fd(_fd), out(_fd, true), game(in, out, options), id(_id)
+        {
+        }
+
+        ~Session()
+        {
+                ::close(fd);
+        }
+
+        bool ready() const
+        {
+                const char *p = in.buf.data();
+                return !over && (started ? whole_message(p + in.pos, p + in.len, false, game.state->player_count, game.state->field.cells())
+                                         : whole_message(p + in.pos, p + in.len, true, 0, 0));
+        }
+
+        // Plays the messages that arrived in full and sends their answers
+        // in one write.
+        void play()
+        {
+                ProfileGameScope scope(&profile);
+                try {
+                        while (ready()) {
+                                if (!started) {
+                                        game.start();
+                                        started = true;
+                                } else if (!game.step(received)) {
+                                        game.finish();
+                                        over = true;
+                                }
+                        }
+                } catch (std::exception &e) {
+                        std::cerr << "session " << fd << ": " << e.what() << "\n";
+                        over = true;
+                }
+                if (!out.flush()) {
+                        over = true;
+                }
+        }
+};
+
+// Serves games over a Unix socket at `path`, one session per connection,
+// each speaking the stdin protocol with its own State. Every round polls
+// all connections and plays the sessions that have a whole message as
+// one batch on a worker pool; --time-ms counts from when a turn arrived.
+// With PROFILE=1 each session's timings are reported when it ends, to
+// --profile-json with the session number appended if that is set, and the
+// process totals at exit. Stops after `limit` finished sessions, or never
+// if it is 0.
+void serve(const std::string &path, unsigned limit, const Options &options)
+{
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+                throw std::invalid_argument("Socket path too long: " + path);
+        }
+        std::copy(path.begin(), path.end(), addr.sun_path);
+        int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        ::unlink(path.c_str());
+        if (listener < 0 || ::bind(listener, (const sockaddr *) &addr, sizeof(addr)) < 0 || ::listen(listener, 64) < 0) {
+                throw std::runtime_error("Cannot listen on " + path);
+        }
+
+        WorkerPool pool(std::max(1u, std::thread::hardware_concurrency()));
+        std::vector<std::unique_ptr<Session>> sessions;
+        std::vector<pollfd> fds;
+        std::vector<Session *> ready;
+        std::vector<char> chunk(1 << 16);
+        unsigned finished = 0, accepted = 0;
+        while (!limit || finished < limit) {
+                fds.assign(1, {listener, POLLIN, 0});
+                for (const auto &s : sessions) {
+                        fds.push_back({s->fd, POLLIN, 0});
+                }
+                if (::poll(fds.data(), fds.size(), -1) < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        throw std::runtime_error("poll failed");
+                }
+                auto now = Deadline::clock::now();
+
+                ready.clear();
+                for (std::size_t j = 1; j < fds.size(); ++j) {
+                        auto &s = *sessions[j - 1];
+                        if (!(fds[j].revents & (POLLIN | POLLHUP | POLLERR))) {
+                                continue;
+                        }
+                        ssize_t got = ::read(s.fd, chunk.data(), chunk.size());
+                        if (got <= 0) {
+                                s.over = got == 0 || errno != EINTR;
+                                continue;
+                        }
+                        s.in.feed(chunk.data(), got);
+                        s.received = now;
+                        if (s.ready()) {
+                                ready.push_back(&s);
+                        }
+                }
+                if (fds[0].revents & POLLIN) {
+                        int fd = ::accept(listener, nullptr, nullptr);
+                        if (fd >= 0) {
+                                sessions.push_back(std::make_unique<Session>(fd, accepted++, options));
+                        }
+                }
+
+                pool.run(ready.size(), [&](unsigned j) {
+                        ready[j]->play();
+                });
+
+                auto gone = std::stable_partition(sessions.begin(), sessions.end(), [](const auto &s) {
+                        return !s->over;
+                });
+                for (auto s = gone; PROFILE && s != sessions.end(); ++s) {
+                        if (options.profile_json.empty()) {
+                                std::cerr << "session " << (*s)->id << " ";
+                        }
+                        profile_report(options.profile_json.empty() ? "" : options.profile_json + "." + std::to_string((*s)->id), &(*s)->profile);
+                }
+                finished += sessions.end() - gone;
+                sessions.erase(gone, sessions.end());
+        }
+        ::close(listener);
+        ::unlink(path.c_str());
+        profile_report(options.profile_json);
+}
+
+// In-process generals engine for local play. Cells carry the CellKind
+// terrain bits (Blocked for mountains, City, Capital) and never Visible;
+// observe() writes a player's fogged view straight into a Field.
+struct Game {
+        unsigned size_x;
+        unsigned size_y;
+        unsigned players;
+        unsigned turn = 0;
+
+        std::vector<uint8_t> kind;
+        std::vector<unsigned> owner;
+        std::vector<unsigned> army;
+        std::vector<unsigned> capital;
+        std::vector<bool> alive;
+
+        Game(unsigned x, unsigned y, unsigned k)
+            : size_x(x), size_y(y), players(k), kind(x * y), owner(x * y), army(x * y),
+              capital(k + 1), alive(k + 1, true)
+        {
+                alive[0] = false;
+        }
+
+        unsigned cells() const
+        {
+                return size_x * size_y;
+        }
+
+        unsigned dist(unsigned i, unsigned j) const
+        {
+                return std::abs((int) (i % size_x) - (int) (j % size_x)) + std::abs((int) (i / size_x) - (int) (j / size_x));
+        }
+
+        // Random map: ~15% mountains, ~4% neutral cities with 40-50 army
+        // and k capitals at least a third of the board apart, all
+        // connected. Each player starts with the plain cells within `start`
+        // steps of its capital, armies 1-6. Rerolls until such a layout is
+        // found.
+        static Game generate(unsigned x, unsigned y, unsigned k, unsigned start, std::mt19937 &rnd)
+        {
+                while (true) {
+                        Game g(x, y, k);
+                        for (unsigned i = 0; i < g.cells(); ++i) {
+                                unsigned r = rnd() % 100;
+                                if (r < 15) {
+                                        g.kind[i] = CellKind::Blocked;
+                                } else if (r < 19) {
+                                        g.kind[i] = CellKind::City;
+                                        g.army[i] = 40 + rnd() % 11;
+                                }
+                        }
+                        unsigned spread = (x + y) / 3;
+                        bool placed = true;
+                        for (unsigned p = 1; p <= k && placed; ++p) {
+                                placed = false;
+                                for (unsigned attempt = 0; attempt < 100 && !placed; ++attempt) {
+                                        unsigned i = rnd() % g.cells();
+                                        placed = g.kind[i] == 0;
+                                        for (unsigned q = 1; q < p && placed; ++q) {
+                                                placed = g.dist(i, g.capital[q]) >= spread;
+                                        }
+                                        if (placed) {
+                                                g.capital[p] = i;
+                                                g.kind[i]    = CellKind::Capital;
+                                                g.owner[i]   = p;
+                                                g.army[i]    = 1;
+                                        }
+                                }
+                        }
+                        if (placed && g.connected()) {
+                                for (unsigned i = 0; i < g.cells(); ++i) {
+                                        for (unsigned p = 1; p <= k; ++p) {
+                                                if (g.kind[i] == 0 && g.owner[i] == 0 && g.dist(i, g.capital[p]) <= start) {
+                                                        g.owner[i] = p;
+                                                        g.army[i]  = 1 + rnd() % 6;
+                                                }
+                                        }
+                                }
+                                return g;
+                        }
+                }
+        }
+
+        Neighbors neighbors(unsigned i) const
+        {
+                Neighbors res;
+                if (i % size_x > 0) {
+                        res.push_back(i - 1);
+                }
+                if (i % size_x + 1 < size_x) {
+                        res.push_back(i + 1);
+                }
+                if (i >= size_x) {
+                        res.push_back(i - size_x);
+                }
+                if (i + size_x < cells()) {
+                        res.push_back(i + size_x);
+                }
+                return res;
+        }
 
-                                {
-                                        PathGeneratorState s;
-                                        s.cur = std::move(greedy_path);
-                                        for (const auto &CellI : s.cur) {
-                                                s.used.insert(CellI);
+        // Every capital reachable from the first one around mountains.
+        bool connected() const
+        {
+                BitBoard open(size_x, size_y), seen(size_x, size_y);
+                for (unsigned i = 0; i < cells(); ++i) {
+                        open.assign(i, !(kind[i] & CellKind::Blocked));
+                }
+                seen.assign(capital[1], true);
+                seen.flood(open);
+                for (unsigned p = 1; p <= players; ++p) {
+                        if (!seen.test(capital[p])) {
+                                return false;
+                        }
+                }
+                return true;
+        }
+
+        // Applies a move by player p if it is legal; returns whether it was.
+        // Taking a capital turns it into a city and hands the loser's land
+        // to p with armies halved.
+        bool apply(unsigned p, const Turn &turn)
+        {
+                const auto *move = std::get_if<Move>(&turn);
+                if (!move) {
+                        return true;
+                }
+                if (move->src.first >= size_x || move->src.second >= size_y || move->dest.first >= size_x || move->dest.second >= size_y) {
+                        return false;
+                }
+                unsigned src  = move->src.second * size_x + move->src.first;
+                unsigned dest = move->dest.second * size_x + move->dest.first;
+                if (owner[src] != p || army[src] <= 1 || dist(src, dest) != 1 || (kind[dest] & CellKind::Blocked)) {
+                        return false;
+                }
+                unsigned units = move->type == MoveType::All ? army[src] - 1 : army[src] / 2;
+                army[src] -= units;
+                if (owner[dest] == p) {
+                        army[dest] += units;
+                } else if (units > army[dest]) {
+                        unsigned lost = owner[dest];
+                        army[dest]    = units - army[dest];
+                        owner[dest]   = p;
+                        if (kind[dest] & CellKind::Capital) {
+                                kind[dest]  = CellKind::City;
+                                alive[lost] = false;
+                                for (unsigned i = 0; i < cells(); ++i) {
+                                        if (owner[i] == lost) {
+                                                owner[i] = p;
+                                                army[i]  = (army[i] + 1) / 2;
                                         }
-                                        s.iterations = 0;
-                                        s.depth = 0;
-                                        s.units      = my_units(s.cur.back()) - 1;
-                                        s.rnd.seed(rnd());
-                                        prev_path = gen_path(s, exit_condition, cmp_res);
                                 }
                         }
+                } else {
+                        army[dest] -= units;
+                }
+                return true;
+        }
 
-                        {
-                                PathGeneratorState s;
-                                s.cur = {begin};
-                                s.iterations = 0;
-                                s.depth = 0;
-                                s.units = my_units(s.cur.back()) - 1;
-                                s.rnd.seed(rnd());
-                                greedy_path = gen_path(s, exit_condition, cmp_res);
+        // End of turn: owned cities and capitals grow every turn, all owned
+        // land every 25th, as State::predict expects.
+        void end_turn()
+        {
+                ++turn;
+                for (unsigned i = 0; i < cells(); ++i) {
+                        if (owner[i] && (turn % 25 == 0 || (kind[i] & (CellKind::City | CellKind::Capital)))) {
+                                ++army[i];
                         }
+                }
+        }
 
-                        if (prev_path.size() >= 2 && path_capture_metric(prev_path) < path_capture_metric(greedy_path)) {
-                                greedy_path = std::move(prev_path);
+        // Player p's view, as the judge would send it: cells next to p's
+        // land (diagonals included) are visible, hidden mountains and
+        // cities show up as obstacles.
+        void observe(unsigned p, std::vector<PlayerInfo> &info, Field &field) const
+        {
+                std::fill(info.begin(), info.end(), PlayerInfo{0, 0});
+                std::vector<bool> visible(cells());
+                for (unsigned i = 0; i < cells(); ++i) {
+                        if (!owner[i]) {
+                                continue;
                         }
-
-                        if (greedy_path.size() < 2) {
-                                throw std::logic_error("Failed to build path");
+                        info[owner[i]].army += army[i];
+                        ++info[owner[i]].land;
+                        if (owner[i] != p) {
+                                continue;
                         }
-                        CellI cur = greedy_path.front();
-                        greedy_path.pop_front();
-                        
-                        auto c = capture_cost(greedy_path.front());
-                        if (c && (unsigned) std::max(*c, 0) > my_units(cur)) {
-                                throw std::logic_error("Tried to capture city");
+                        unsigned x = i % size_x, y = i / size_x;
+                        for (unsigned yy = y ? y - 1 : 0; yy <= std::min(y + 1, size_y - 1); ++yy) {
+                                for (unsigned xx = x ? x - 1 : 0; xx <= std::min(x + 1, size_x - 1); ++xx) {
+                                        visible[yy * size_x + xx] = true;
+                                }
+                        }
+                }
+                field.begin_update();
+                for (unsigned i = 0; i < cells(); ++i) {
+                        if (!visible[i]) {
+                                field.store(i, kind[i] & (CellKind::Blocked | CellKind::City) ? CellKind::Blocked : 0, 0, 0);
+                        } else if (kind[i] & CellKind::Blocked) {
+                                field.store(i, CellKind::Visible | CellKind::Blocked, 0, 0);
+                        } else {
+                                field.store(i, CellKind::Visible | kind[i], owner[i], army[i]);
                         }
-
-                        return Move{MoveType::All, cur, greedy_path.front()};
                 }
         }
 
-        struct PathCollectMetric {
-                int collected;
-                int dist;
+        unsigned survivors() const
+        {
+                return std::count(alive.begin(), alive.end(), true);
+        }
+};
 
-                bool operator<(const PathCollectMetric &other) {
-                        return collected > other.collected || (collected == other.collected && dist < other.dist);
-                }
-        };
+// Writes a judge-format stream of a synthetic game: our territory grows
+// around a capital in one corner, an enemy blob sits in the other, armies
+// are rerolled every turn. Used to benchmark builds against each other.
+void write_synthetic_stream(std::ostream &out, unsigned n, unsigned m, unsigned turns, unsigned seed)
+{
+        std::mt19937 rnd(seed);
+        const unsigned k = 2, id = 1;
+        out << n << " " << m << " " << k << " " << id << "\n";
+
+        std::vector<int> type(n * m, 1);
+        for (auto &t : type) {
+                t = rnd() % 10 == 0 ? 4 : (rnd() % 30 == 0 ? 2 : 1);
+        }
+        CellI cap[2] = {{m / 4, n / 4}, {3 * m / 4, 3 * n / 4}};
+        for (unsigned p = 0; p < 2; ++p) {
+                type[cap[p].second * m + cap[p].first] = 3;
+        }
 
-        PathCollectMetric path_collect_metric(const std::deque<CellI> &path) const {
-                int cur_collected = 0;
-                int cur_dist = 0;
-                for (const auto &pos : path) {
-                        cur_collected -= *capture_cost(pos);
-                        cur_dist = field.dist(pos, capital.find(player_id)->second.first);
+        for (unsigned t = 1; t <= turns; ++t) {
+                unsigned radius = std::min(n + m, 2 + t / 8);
+                std::vector<unsigned> owner(n * m, 0), size(n * m, 0);
+                for (unsigned y = 0; y < n; ++y) {
+                        for (unsigned x = 0; x < m; ++x) {
+                                unsigned i = y * m + x;
+                                if (type[i] == 4) {
+                                        continue;
+                                }
+                                for (unsigned p = 0; p < 2; ++p) {
+                                        unsigned d = std::abs((int) x - (int) cap[p].first) + std::abs((int) y - (int) cap[p].second);
+                                        if (d <= radius && owner[i] == 0) {
+                                                owner[i] = p + 1;
+                                                size[i]  = 1 + rnd() % (type[i] == 1 ? 20 : 60);
+                                        }
+                                }
+                                if (owner[i] == 0 && type[i] == 2) {
+                                        size[i] = 40;
+                                }
+                        }
                 }
-                return {cur_collected, cur_dist};
-        };
+                std::vector<unsigned> army(k + 1, 0), land(k + 1, 0);
+                for (unsigned i = 0; i < n * m; ++i) {
+                        if (owner[i] <= k) {
+                                army[owner[i]] += size[i];
+                                ++land[owner[i]];
+                        }
+                }
+                out << "1\n";
+                for (unsigned p = 1; p <= k; ++p) {
+                        out << army[p] << " " << land[p] << "\n";
+                }
+                for (unsigned y = 0; y < n; ++y) {
+                        for (unsigned x = 0; x < m; ++x) {
+                                bool visible = false;
+                                for (int dy = -1; dy <= 1; ++dy) {
+                                        for (int dx = -1; dx <= 1; ++dx) {
+                                                int yy = y + dy, xx = x + dx;
+                                                if (yy >= 0 && xx >= 0 && yy < (int) n && xx < (int) m && owner[yy * m + xx] == id) {
+                                                        visible = true;
+                                                }
+                                        }
+                                }
+                                unsigned i = y * m + x;
+                                if (!visible) {
+                                        out << "0 " << (type[i] == 1 ? 1 : 2) << " ";
+                                } else if (type[i] == 4) {
+                                        out << "1 4 ";
+                                } else {
+                                        out << "1 " << type[i] << " " << owner[i] << " " << size[i] << " ";
+                                }
+                        }
+                        out << "\n";
+                }
+        }
+        out << "0\n";
+}
 
-        std::deque<CellI> collect_path;
-        unsigned collected_len;
+// Replays a turn stream through State and reports the mean per-turn cost
+// of each phase on stderr.
+template <class Input>
+void bench_turns(Input &in, const Options &options)
+{
+        using clock = std::chrono::steady_clock;
+        auto us = [](clock::duration d) {
+                return std::chrono::duration<double, std::micro>(d).count();
+        };
 
-        std::deque<CellI> attack_path;
+        unsigned n, m, k, id;
+        in >> n >> m >> k >> id;
+        State state(m, n, k, id, options);
 
-        Turn trahat() {
-                CellI src = collect_path.front();
-                if (my_units(src) == 0) {
-                        collected_len = 0;
-                        collect_path.clear();
+        unsigned turns = 0;
+        double t_read = 0, t_dist = 0, t_info = 0, t_cells = 0, t_turn = 0, t_turn_max = 0;
+        while (true) {
+                int is_ok;
+                in >> is_ok;
+                if (!is_ok) {
+                        break;
+                }
+                // read_next, split into its steps so each is timed once.
+                auto t0 = clock::now();
+                state.read_input(in);
+                auto t1 = clock::now();
+                for (auto &a : state.arenas) {
+                        a.reset();
+                }
+                state.distances.update(state.field);
+                auto t2 = clock::now();
+                state.update_info();
+                auto t3 = clock::now();
+                volatile std::size_t cells = state.my_cells().size();
+                (void) cells;
+                Deadline deadline;
+                if (options.time_ms) {
+                        deadline = Deadline::after(std::chrono::milliseconds(options.time_ms));
                 }
+                auto t4 = clock::now();
+                try {
+                        state.do_turn(deadline);
+                } catch (std::exception &) {
+                }
+                auto t5 = clock::now();
+                t_read += us(t1 - t0);
+                t_dist += us(t2 - t1);
+                t_info += us(t3 - t2);
+                t_cells += us(t4 - t3);
+                t_turn += us(t5 - t4);
+                t_turn_max = std::max(t_turn_max, us(t5 - t4));
+                ++turns;
+        }
+        turns = std::max(turns, 1u);
+        std::cerr << std::fixed << std::setprecision(2)
+                  << "board " << n << "x" << m << ", " << turns << " turns, us/turn:"
+                  << " read_table " << t_read / turns
+                  << " distances " << t_dist / turns
+                  << " update_info " << t_info / turns
+                  << " my_cells " << t_cells / turns
+                  << " do_turn " << t_turn / turns << " (max " << t_turn_max << ")\n";
+        profile_report(options.profile_json);
+}
+
+struct ArenaConfig {
+        unsigned games   = 100;
+        unsigned players = 2;
+        unsigned size    = 20;
+        unsigned turns   = 500;
+        unsigned seed    = 1;
+        unsigned start   = 3;
+};
 
-//                std::cerr << "Attacking from " << src.first << " " << src.second << std::endl;
+struct ArenaResult {
+        unsigned winner   = 0;
+        unsigned turns    = 0;
+        unsigned errors   = 0;
+        unsigned rejected = 0;
+        std::vector<double> latency;
+};
 
-                std::queue<CellI> q;
-                std::unordered_map<CellI, CellI> prev;
-                std::unordered_map<CellI, int> dist;
-                dist[src] = 0;
-                prev[src] = src;
-                q.push(src);
-                while (!q.empty())  {
-                        auto v = q.front();
-                        q.pop();
+// Plays one game between a bot with `challenger` options (player 1) and
+// players - 1 bots with `rival` options. Bots see fogged views through
+// Game::observe and are called without text I/O; latency is the
+// ingest plus do_turn time of every bot turn, in microseconds. Moves are
+// applied in player order, starting from a different player every turn.
+ArenaResult play_arena_game(const ArenaConfig &config, unsigned seed, const Options &challenger, const Options &rival)
+{
+        using clock = std::chrono::steady_clock;
 
-                        for (const auto &u : field.neighbors(v)) {
-                                if (can_pass(field.at(u)) && (dist.find(u) == dist.end() || dist[u] > dist[v] + 1)) {
-                                        dist[u] = dist[v] + 1;
-                                        q.push(u);
-                                        prev[u] = v;
-                                }
-                        }
-                }
+        std::mt19937 rnd(seed);
+        Game game = Game::generate(config.size, config.size, config.players, config.start, rnd);
+        std::vector<std::unique_ptr<State>> bots;
+        bots.push_back(nullptr);
+        for (unsigned p = 1; p <= config.players; ++p) {
+                bots.push_back(std::make_unique<State>(game.size_x, game.size_y, config.players, p, p == 1 ? challenger : rival));
+        }
 
-                std::optional<CellI> nearest;
-                for (unsigned x = 0; x < field.size_x; ++x) {
-                        for (unsigned y = 0; y < field.size_y; ++y) {
-                                const auto &armed = get_armed(field.at({x, y}));
-                                if (((!exists_not_me && (!armed || armed->army.owner != player_id)) || (armed && armed->army.owner != player_id && armed->army.owner != 0)) && dist.find({x, y}) != dist.end()) {
-                                        if (!nearest || dist[{x, y}] < dist[*nearest]) {
-                                                nearest = {x, y};
-                                        }
-                                }
+        ArenaResult res;
+        std::vector<Turn> turns(config.players + 1, Skip{});
+        while (game.turn < config.turns && game.survivors() > 1) {
+                for (unsigned p = 1; p <= config.players; ++p) {
+                        turns[p] = Skip{};
+                        if (!game.alive[p]) {
+                                continue;
                         }
-                }
-                for (const auto &[id, cap] : capital) {
-                        if (id != player_id && dist.find(cap.first) != dist.end()) {
-                                nearest = cap.first;
+                        State &bot = *bots[p];
+                        auto t0 = clock::now();
+                        ++bot.turn_num;
+                        game.observe(p, bot.info, bot.field);
+                        bot.ingest();
+                        try {
+                                turns[p] = bot.do_turn();
+                                bot.check(turns[p]);
+                        } catch (std::exception &) {
+                                turns[p] = Skip{};
+                                ++res.errors;
                         }
+                        res.latency.push_back(std::chrono::duration<double, std::micro>(clock::now() - t0).count());
                 }
-
-                if (!nearest) {
-                        collected_len = 0;
-                        collect_path.clear();
-                        return Skip{};
-                } else {
-                        assert(dist.find(*nearest) != dist.end());
-                        CellI cur_pos = *nearest;
-                        while (prev[cur_pos] != src) {
-                                cur_pos = prev[cur_pos];
+                for (unsigned j = 0; j < config.players; ++j) {
+                        unsigned p = (game.turn + j) % config.players + 1;
+                        if (game.alive[p] && !game.apply(p, turns[p])) {
+                                ++res.rejected;
                         }
-                        collect_path = {cur_pos};
-                        return Move{MoveType::All, src, cur_pos};
                 }
+                game.end_turn();
         }
+        if (game.survivors() == 1) {
+                res.winner = std::find(game.alive.begin(), game.alive.end(), true) - game.alive.begin();
+        }
+        res.turns = game.turn;
+        return res;
+}
 
-        Turn midgame() {
-                unsigned collect_len = std::min((unsigned)my_cells().size() / 2, field.size_x * field.size_y / 40);
-                if (collected_len + 1 == collect_len) {
-                        return trahat();
-                } else {
-                        auto cmp_res = [&](const std::deque<CellI> &x, const std::deque<CellI> &y) -> bool {
-                                return path_collect_metric(x) < path_collect_metric(y);
-                        };
-                        auto exit_condition = [&](const PathGeneratorState &s) -> bool {
-                                return s.depth >= 10 || s.cur.size() >= collect_len - collected_len;
-                        };
+// Plays config.games self-play games across all cores (game j uses seed
+// config.seed + j, so results do not depend on scheduling) and reports
+// throughput, latency percentiles and win rates per seat on stderr.
+void run_arena(const ArenaConfig &config, const Options &challenger, const Options &rival)
+{
+        std::vector<ArenaResult> results(config.games);
+        auto start = std::chrono::steady_clock::now();
+        {
+                WorkerPool pool(std::max(1u, std::thread::hardware_concurrency()));
+                pool.run(config.games, [&](unsigned j) {
+                        results[j] = play_arena_game(config, config.seed + j, challenger, rival);
+                });
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
 
-                        CellI begin;
-                        std::deque<CellI> prev_path;
-                        if (collect_path.empty() || my_units(collect_path.front()) == 0) {
-                                collected_len = 0;
-                                std::vector<CellI> cells = my_cells();
-                                sort(cells.begin(), cells.end(), [&](const CellI &a, const CellI &b) {
-                                                return my_units(a) > my_units(b);
-                                });
-                                begin = cells[rnd() % std::min(30u, (unsigned)cells.size())];
-                        } else {
-                                begin = collect_path.front();
+        std::vector<double> latency;
+        std::vector<unsigned> wins(config.players + 1);
+        unsigned long long turns = 0, errors = 0, rejected = 0;
+        for (const auto &r : results) {
+                latency.insert(latency.end(), r.latency.begin(), r.latency.end());
+                ++wins[r.winner];
+                turns += r.turns;
+                errors += r.errors;
+                rejected += r.rejected;
+        }
+        std::sort(latency.begin(), latency.end());
+        auto percentile = [&](double q) {
+                return latency.empty() ? 0.0 : latency[std::min(latency.size() - 1, (std::size_t) (q * latency.size()))];
+        };
 
-                                {
-                                        PathGeneratorState s;
-                                        s.cur = std::move(collect_path);
-                                        for (const auto &CellI : s.cur) {
-                                                s.used.insert(CellI);
-                                        }
-                                        s.iterations = 0;
-                                        s.depth = 0;
-                                        s.units      = std::max(0, path_collect_metric(s.cur).collected);
-                                        s.rnd.seed(rnd());
-                                        prev_path = gen_path(s, exit_condition, cmp_res);
-                                }
-                        }
+        std::cerr << std::fixed << std::setprecision(2)
+                  << "arena: " << config.games << " games, " << config.players << " players, "
+                  << config.size << "x" << config.size << ", " << elapsed.count() << " s, "
+                  << config.games / elapsed.count() * 60 << " games/min, "
+                  << turns / elapsed.count() << " turns/s, " << errors << " bot errors, "
+                  << rejected << " rejected moves\n"
+                  << "bot turn us: p50 " << percentile(0.5) << " p90 " << percentile(0.9)
+                  << " p99 " << percentile(0.99) << " max " << (latency.empty() ? 0.0 : latency.back()) << "\n";
+        for (unsigned p = 1; p <= config.players; ++p) {
+                std::cerr << "player " << p << (p == 1 ? " (challenger)" : "") << ": "
+                          << wins[p] << " wins (" << 100.0 * wins[p] / std::max(config.games, 1u) << "%)\n";
+        }
+        std::cerr << "unfinished: " << wins[0] << "\n";
+        profile_report(challenger.profile_json);
+}
 
-                        {
-                                PathGeneratorState s;
-                                s.cur = {begin};
-                                s.used = {};
-                                s.iterations = 0;
-                                s.depth = 0;
-                                s.units = my_units(s.cur.back()) - 1;
-                                s.rnd.seed(rnd());
-                                collect_path = gen_path(s, exit_condition, cmp_res);
-                        }
+// Feeds a recorded game back through read_next and do_turn as fast as
+// possible and reports per-turn CPU time, heap allocations and the turns
+// whose answer differs from the recorded one on stderr. With --max-allocs
+// it fails if any turn allocates more than that in read_next and do_turn
+// together. Only these turns are exempt: the first `warmup` turns, while
+// the arenas grow to their working size; turns where do_turn or check
+// threw, since the exception and its message allocate; and, with
+// --gather=tree, turns whose reset grew the turn arena, because
+// plan_gather's knapsack table scales with the gather budget and is not
+// sized up front. Allocations are only counted in a -DCOUNT_ALLOCS=1
+// build.
+bool run_replay(const std::string &path, const Options &options)
+{
+        constexpr unsigned warmup = 10;
 
-                        if (prev_path.size() >= 2 && path_collect_metric(prev_path) < path_collect_metric(collect_path)) {
-                                collect_path = std::move(prev_path);
-                        }
+        if (options.max_allocs && !COUNT_ALLOCS) {
+                std::cerr << "replay: --max-allocs needs a build with -DCOUNT_ALLOCS=1\n";
+                return false;
+        }
 
-                        if (collect_path.size() < 2) {
-                                collect_path.clear();
-                                collected_len = 0;
-                                throw std::logic_error("Failed to build path");
-                        }
+        auto cpu_us = [] {
+                timespec ts;
+                clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+                return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+        };
 
-                        CellI cur = collect_path.front();
-                        ++collected_len;
-                        collect_path.pop_front();
-                        
-                        auto c = capture_cost(collect_path.front());
-                        if (c && (unsigned) std::max(*c, 0) > my_units(cur)) {
-                                throw std::logic_error("Tried to capture uncapturable");
-                        }
+        ReplayReader in(path);
+        unsigned n, m, k, id;
+        in >> n >> m >> k >> id;
+        State state(m, n, k, id, options);
 
-                        return Move{MoveType::All, cur, collect_path.front()};
+        struct Sample {
+                double cpu;
+                unsigned long long allocs;
+                unsigned turn;
+        };
+        std::vector<Sample> samples;
+        std::vector<unsigned> diverged;
+        std::vector<unsigned> over_limit;
+        unsigned errors = 0, grown = 0;
+        std::vector<Turn> answers;
+        auto arena_bytes = [&] {
+                std::size_t res = 0;
+                for (const auto &a : state.arenas) {
+                        res += a.buffer.size();
                 }
-                return Skip{};
+                return res;
+        };
+        double read_cpu = 0;
+        unsigned long long read_allocs = 0;
+        while (true) {
+                int is_ok;
+                in >> is_ok;
+                if (!is_ok) {
+                        break;
+                }
+                const std::size_t arena0 = arena_bytes();
+                auto a0 = allocation_count();
+                auto c0 = cpu_us();
+                state.read_next(in);
+                auto a1 = allocation_count();
+                auto c1 = cpu_us();
+                Turn recorded = in.turn();
+
+                Deadline deadline;
+                if (options.time_ms) {
+                        deadline = Deadline::after(std::chrono::milliseconds(options.time_ms));
+                }
+                auto a2 = allocation_count();
+                auto c2 = cpu_us();
+                Turn turn = Skip{};
+                bool failed = false;
+                try {
+                        turn = state.do_turn(deadline);
+                        state.check(turn);
+                } catch (std::exception &) {
+                        turn = Skip{};
+                        failed = true;
+                }
+                auto c3 = cpu_us();
+                auto a3 = allocation_count();
+
+                read_cpu += c1 - c0;
+                read_allocs += a1 - a0;
+                samples.push_back({c3 - c2, a3 - a2, state.turn_num});
+                const bool grew = options.gather == Gather::Tree && arena_bytes() > arena0;
+                errors += failed && state.turn_num > warmup;
+                grown += grew && !failed && state.turn_num > warmup;
+                if (options.max_allocs && state.turn_num > warmup && !failed && !grew && a3 - a0 > *options.max_allocs) {
+                        over_limit.push_back(state.turn_num);
+                }
+                if (!(turn == recorded)) {
+                        diverged.push_back(state.turn_num);
+                }
+                answers.push_back(turn);
+        }
+        if (samples.empty()) {
+                std::cerr << "replay: no turns\n";
+                return true;
         }
 
-        void check(const Turn &a) const
-        {
-                if (std::holds_alternative<Skip>(a)) {
-                        return;
-                } else if (std::holds_alternative<Move>(a)) {
-                        const auto &[type, from, to] = std::get<Move>(a);
-                        if (my_units(from) == 0) {
-                                throw std::logic_error("Invalid turn: no units in source");
-                        }
-                        if (field.dist(from, to) != 1) {
-                                throw std::logic_error("Invalid turn: sources does not neighbor destination");
-                        }
-                        const auto &c = field.at(to);
-                        if (!std::holds_alternative<Visible>(c) || !std::holds_alternative<Armed>(std::get<Visible>(c))) {
-                                throw std::logic_error("Invalid turn: unarmed destination");
-                        }
-                } else {
-                        throw std::logic_error("Invalid turn: empty turn");
+        // Sends the answers to /dev/null through an std::ostream flushed
+        // after every line, the way the bot used to, with TurnWriter, and
+        // with TurnWriter batching the whole game; ns per answer.
+        auto output_ns = [&](auto &&send) {
+                const unsigned reps = std::max<std::size_t>(1, 20000 / answers.size());
+                auto c0 = cpu_us();
+                for (unsigned r = 0; r < reps; ++r) {
+                        send();
+                }
+                return (cpu_us() - c0) * 1e3 / (reps * answers.size());
+        };
+        std::ofstream null_stream("/dev/null");
+        int null_fd = ::open("/dev/null", O_WRONLY);
+        TurnWriter writer(null_fd), batched(null_fd, true);
+        double stream_ns = output_ns([&] {
+                char text[max_turn_text];
+                for (const auto &t : answers) {
+                        null_stream.write(text, format_turn(t, text)).flush();
+                }
+        });
+        double writer_ns = output_ns([&] {
+                for (const auto &t : answers) {
+                        writer.put(t);
+                }
+        });
+        double batched_ns = output_ns([&] {
+                for (const auto &t : answers) {
+                        batched.put(t);
                 }
+                batched.flush();
+        });
+        ::close(null_fd);
+
+        const std::size_t turns = samples.size();
+        double cpu_total = 0;
+        unsigned long long allocs_total = 0, allocs_max = 0;
+        for (const auto &s : samples) {
+                cpu_total += s.cpu;
+                allocs_total += s.allocs;
+                allocs_max = std::max(allocs_max, s.allocs);
         }
+        auto by_cpu = samples;
+        std::sort(by_cpu.begin(), by_cpu.end(), [](const Sample &a, const Sample &b) {
+                return a.cpu < b.cpu;
+        });
+        auto percentile = [&](double q) {
+                return by_cpu[std::min(turns - 1, (std::size_t) (q * turns))].cpu;
+        };
 
-        
-        Turn do_turn()
-        {
-                if (field.size_x * field.size_y <= 50 && (turn_num <= 2 * field.size_x * field.size_y && !exists_not_me)) {
-                        return greedy_start();
+        std::cerr << std::fixed << std::setprecision(2)
+                  << "replay: " << turns << " turns, " << n << "x" << m << "\n"
+                  << "read_next cpu us/turn " << read_cpu / turns;
+        if (COUNT_ALLOCS) {
+                std::cerr << ", allocations/turn " << (double) read_allocs / turns;
+        }
+        std::cerr << "\n"
+                  << "do_turn cpu us: mean " << cpu_total / turns << " p50 " << percentile(0.5)
+                  << " p99 " << percentile(0.99) << " max " << by_cpu.back().cpu << "\n";
+        if (COUNT_ALLOCS) {
+                std::cerr << "do_turn allocations/turn: mean " << (double) allocs_total / turns << " max " << allocs_max << "\n";
+        }
+        std::cerr << "answer output ns/turn: ostream+flush " << stream_ns << " turn_writer " << writer_ns
+                  << " batched " << batched_ns << "\n"
+                  << "slowest turns:";
+        for (std::size_t j = 0; j < std::min<std::size_t>(5, turns); ++j) {
+                std::cerr << " " << by_cpu[turns - 1 - j].turn;
+        }
+        std::cerr << "\ndivergent turns: " << diverged.size();
+        for (std::size_t j = 0; j < std::min<std::size_t>(10, diverged.size()); ++j) {
+                std::cerr << (j ? " " : " (first: ") << diverged[j];
+        }
+        std::cerr << (diverged.empty() ? "" : ")") << "\n";
+        if (options.max_allocs) {
+                std::cerr << "turns over " << *options.max_allocs << " allocations (exempt: " << warmup << " warm-up, "
+                          << errors << " error";
+                if (options.gather == Gather::Tree) {
+                        std::cerr << ", " << grown << " gather-tree arena growth";
+                }
+                std::cerr << "): " << over_limit.size();
+                for (std::size_t j = 0; j < std::min<std::size_t>(10, over_limit.size()); ++j) {
+                        std::cerr << (j ? " " : " (first: ") << over_limit[j];
+                }
+                std::cerr << (over_limit.empty() ? "" : ")") << "\n";
+        }
+        profile_report(options.profile_json);
+        return over_limit.empty();
+}
+
+Options parse_options(const std::vector<std::string> &args)
+{
+        Options res;
+        for (const auto &arg : args) {
+                auto eq = arg.find('=');
+                std::string key = arg.substr(0, eq);
+                std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+                if (key == "--planner" && value == "dfs") {
+                        res.planner = Planner::Dfs;
+                } else if (key == "--planner" && value == "beam") {
+                        res.planner = Planner::Beam;
+                } else if (key == "--gather" && value == "path") {
+                        res.gather = Gather::Path;
+                } else if (key == "--gather" && value == "tree") {
+                        res.gather = Gather::Tree;
+                } else if (key == "--attack" && value == "heuristic") {
+                        res.attack = Attack::Heuristic;
+                } else if (key == "--attack" && value == "mcts") {
+                        res.attack = Attack::Mcts;
+                } else if (key == "--tt-bits" && std::stoul(value) <= 30) {
+                        res.tt_bits = std::stoul(value);
+                } else if (key == "--route" && value == "steps") {
+                        res.route = Route::Steps;
+                } else if (key == "--route" && value == "army") {
+                        res.route = Route::Army;
+                } else if (key == "--beam-width") {
+                        res.beam_width = std::stoul(value);
+                } else if (key == "--time-ms") {
+                        res.time_ms = std::stoul(value);
+                } else if (key == "--threads") {
+                        res.threads = std::max(1ul, std::stoul(value));
+                } else if (key == "--record" && !value.empty()) {
+                        res.record = value;
+                } else if (key == "--profile-json" && !value.empty()) {
+                        res.profile_json = value;
+                } else if (key == "--max-allocs") {
+                        res.max_allocs = std::stoul(value);
+                } else if (key == "--speculate") {
+                        res.speculate = true;
+                } else if (key == "--belief") {
+                        res.belief = true;
+                } else if (key == "--commit") {
+                        res.commit = true;
+                } else if (key == "--frontier") {
+                        res.frontier = true;
+                } else if (key == "--stream-input") {
+                        res.fast_input = false;
                 } else {
-                        return midgame();
+                        throw std::invalid_argument("Unknown option " + arg);
                 }
         }
-};
+        return res;
+}
 
-struct Interactor {
-        std::istream &in;
-        std::ostream &out;
+// Times the board scans on a random size x size board, scalar against the
+// dispatched version, and reports ns per scan on stderr.
+void bench_scan(unsigned size, unsigned reps)
+{
+        const unsigned n = size * size, player = 1;
+        std::mt19937 rnd(1);
+        std::vector<unsigned> dist(n), owner(n);
+        std::vector<uint8_t> kind(n);
+        for (unsigned i = 0; i < n; ++i) {
+                unsigned r = rnd() % 100;
+                kind[i]  = r < 15 ? CellKind::Blocked : r < 60 ? CellKind::Visible : 0;
+                kind[i] |= kind[i] == CellKind::Visible && rnd() % 20 == 0 ? CellKind::City : 0;
+                owner[i] = kind[i] & CellKind::Visible ? rnd() % 3 : 0;
+                dist[i]  = kind[i] & CellKind::Blocked ? DistanceField::inf : rnd() % (2 * size) + 1;
+        }
+        // Own cells everywhere near: the nearest foreign one is far in.
+        for (unsigned i = 0; i < n / 2; ++i) {
+                if (kind[i] == CellKind::Visible) {
+                        owner[i] = player;
+                }
+        }
 
-        void run()
-        {
-                unsigned n, m, k, id;
-                std::cin >> n >> m >> k >> id;
+        auto time = [&](auto &&f) {
+                unsigned long long sink = 0;
+                auto start = std::chrono::steady_clock::now();
+                for (unsigned r = 0; r < reps; ++r) {
+                        sink += f(r);
+                }
+                std::chrono::duration<double, std::nano> total = std::chrono::steady_clock::now() - start;
+                return std::make_pair(total.count() / reps, sink);
+        };
+        std::vector<unsigned> out;
+        out.reserve(n);
+        // Alternate the player so the compiler cannot hoist the scan.
+        auto nearest_scalar = [&](unsigned r) {
+                return nearest_foreign_scalar(dist.data(), owner.data(), kind.data(), n, player + (r & 1));
+        };
+        auto nearest = [&](unsigned r) {
+                return nearest_foreign(dist.data(), owner.data(), kind.data(), n, player + (r & 1));
+        };
+        auto growing_scalar = [&](unsigned r) {
+                out.clear();
+                growing_cells_scalar(owner.data(), kind.data(), n, player, r & 1, out);
+                return out.size();
+        };
+        auto growing = [&](unsigned r) {
+                out.clear();
+                growing_cells(owner.data(), kind.data(), n, player, r & 1, out);
+                return out.size();
+        };
 
-                State state(m, n, k, id);
+        auto [ns0, s0] = time(nearest_scalar);
+        auto [ns1, s1] = time(nearest);
+        auto [ns2, s2] = time(growing_scalar);
+        auto [ns3, s3] = time(growing);
+        std::cerr << std::fixed << std::setprecision(1) << size << "x" << size << (have_avx2() ? " avx2" : " scalar only")
+                  << (s0 == s1 && s2 == s3 ? "" : " MISMATCH") << ", ns/scan:\n"
+                  << "nearest_foreign scalar " << ns0 << " dispatched " << ns1 << " speedup " << ns0 / ns1 << "x\n"
+                  << "growing_cells scalar " << ns2 << " dispatched " << ns3 << " speedup " << ns2 / ns3 << "x\n";
+}
+
+// Times the bitboard kernels against the cell-at-a-time code on a random
+// size x size board with our land on the top half: BFS distances by
+// DistanceField's queue and by BitBoard::rings, reachability by the same
+// queue and by flood, and our border by a neighbour scan and by
+// Field::border. Reports us per call on stderr.
+void bench_flood(unsigned size, unsigned reps)
+{
+        const unsigned n = size * size, player = 1;
+        std::mt19937 rnd(1);
+        Field field(size, size, player);
+        for (unsigned i = 0; i < n; ++i) {
+                unsigned r = rnd() % 100;
+                if (r < 15) {
+                        field.store(i, CellKind::Visible | CellKind::Blocked, 0, 0);
+                } else if (r < 60) {
+                        field.store(i, CellKind::Visible, i < n / 2 ? player : rnd() % 3, 1 + rnd() % 9);
+                }
+        }
+        // Start in the middle, with the way out open.
+        const unsigned source = n / 2 + size / 2;
+        field.store(source, CellKind::Visible, player, 1);
+        for (unsigned u : field.neighbors(source)) {
+                field.store(u, CellKind::Visible, player, 1);
+        }
+
+        auto time = [&](auto &&f) {
+                unsigned long long sink = 0;
+                auto start = std::chrono::steady_clock::now();
+                for (unsigned r = 0; r < reps; ++r) {
+                        sink += f();
+                }
+                std::chrono::duration<double, std::micro> total = std::chrono::steady_clock::now() - start;
+                return std::make_pair(total.count() / reps, sink);
+        };
+        DistanceField queue(field, source);
+        std::vector<unsigned> dist;
+        BitBoard seen(size, size), layer(size, size), next(size, size), out(size, size), scratch(size, size);
+        auto bfs = [&] {
+                queue.rebuild(field);
+                return queue.dist[n - 1];
+        };
+        auto rings = [&] {
+                dist.assign(n, DistanceField::inf);
+                dist[source] = 0;
+                BitBoard::rings(source, field.masks.passable, seen, layer, next, [&](unsigned i, unsigned d) {
+                        dist[i] = d;
+                });
+                return dist[n - 1];
+        };
+        auto reach_bfs = [&] {
+                queue.rebuild(field);
+                return (unsigned long long) std::count_if(queue.dist.begin(), queue.dist.end(), [](unsigned d) {
+                        return d != DistanceField::inf;
+                });
+        };
+        auto reach_flood = [&] {
+                out.clear();
+                out.assign(source, true);
+                out.flood(field.masks.passable);
+                return (unsigned long long) out.count();
+        };
+        auto border_scan = [&] {
+                unsigned long long res = 0;
+                for (unsigned i = 0; i < n; ++i) {
+                        if (field.armed(i) && field.owner[i] == player) {
+                                for (unsigned u : field.neighbors(i)) {
+                                        if (field.passable(u) && !(field.armed(u) && field.owner[u] == player)) {
+                                                ++res;
+                                                break;
+                                        }
+                                }
+                        }
+                }
+                return res;
+        };
+        auto border_bits = [&] {
+                field.border(out, scratch);
+                return (unsigned long long) out.count();
+        };
+
+        auto [us0, s0] = time(bfs);
+        auto [us1, s1] = time(rings);
+        bool same = dist == queue.dist;
+        auto [us2, s2] = time(reach_bfs);
+        auto [us3, s3] = time(reach_flood);
+        auto [us4, s4] = time(border_scan);
+        auto [us5, s5] = time(border_bits);
+        std::cerr << std::fixed << std::setprecision(2) << size << "x" << size
+                  << (same && s0 == s1 && s2 == s3 && s4 == s5 ? "" : " MISMATCH") << ", us/call:\n"
+                  << "distances queue " << us0 << " rings " << us1 << " speedup " << us0 / us1 << "x\n"
+                  << "reachable queue " << us2 << " flood " << us3 << " speedup " << us2 / us3 << "x\n"
+                  << "border scan " << us4 << " bitboard " << us5 << " speedup " << us4 / us5 << "x\n";
+}
 
+// Replays a recorded stream through the std::istream and the FdReader
+// parsers and reports the mean read_next cost of each on stderr.
+void bench_parse(const std::string &path)
+{
+        auto replay = [&](auto &in) {
+                unsigned n, m, k, id;
+                in >> n >> m >> k >> id;
+                State state(m, n, k, id);
+                unsigned turns = 0;
+                auto start = std::chrono::steady_clock::now();
                 while (true) {
                         int is_ok;
                         in >> is_ok;
@@ -689,25 +5062,100 @@ struct Interactor {
                                 break;
                         }
                         state.read_next(in);
-                        try {
-                                const auto turn = state.do_turn();
-                                state.check(turn);
-                                out << turn;
-                        } catch (std::exception &e) {
-                                std::cerr << e.what() << "\n";
-                                out << Turn{Skip{}};
-                        }
+                        ++turns;
                 }
+                std::chrono::duration<double, std::micro> total = std::chrono::steady_clock::now() - start;
+                return std::make_pair(total.count() / std::max(turns, 1u), turns);
+        };
+
+        std::ifstream stream(path);
+        if (!stream) {
+                throw std::runtime_error("Cannot open " + path);
         }
-};
+        auto [slow, turns] = replay(stream);
+
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+                throw std::runtime_error("Cannot open " + path);
+        }
+        FdReader reader(fd);
+        auto fast = replay(reader).first;
+        ::close(fd);
+
+        std::cerr << std::fixed << std::setprecision(2) << turns << " turns, read_next us/turn:"
+                  << " istream " << slow << " fd_reader " << fast
+                  << " speedup " << slow / fast << "x\n";
+}
 
-int main()
+int main(int argc, char **argv)
 {
         std::ios::sync_with_stdio(false);
         std::cin.tie(nullptr);
         std::cerr.tie(nullptr);
 
-        Interactor inter{std::cin, std::cout};
+        std::vector<std::string> args(argv + 1, argv + argc);
+        if (!args.empty() && args[0] == "--bench-stream") {
+                auto arg = [&](std::size_t i, unsigned def) {
+                        return i < args.size() ? (unsigned) std::stoul(args[i]) : def;
+                };
+                write_synthetic_stream(std::cout, arg(1, 40), arg(2, 40), arg(3, 200), arg(4, 1));
+                return 0;
+        }
+        if (!args.empty() && args[0] == "--bench-scan") {
+                bench_scan(args.size() > 1 ? std::stoul(args[1]) : 100, args.size() > 2 ? std::stoul(args[2]) : 20000);
+                return 0;
+        }
+        if (!args.empty() && args[0] == "--bench-flood") {
+                bench_flood(args.size() > 1 ? std::stoul(args[1]) : 100, args.size() > 2 ? std::stoul(args[2]) : 2000);
+                return 0;
+        }
+        if (args.size() == 2 && args[0] == "--bench-parse") {
+                bench_parse(args[1]);
+                return 0;
+        }
+        if (!args.empty() && args[0] == "--arena") {
+                ArenaConfig config;
+                unsigned *fields[] = {&config.games, &config.players, &config.size, &config.turns, &config.seed, &config.start};
+                std::size_t a = 1;
+                for (auto *f : fields) {
+                        if (a < args.size() && std::isdigit((unsigned char) args[a][0])) {
+                                *f = std::stoul(args[a++]);
+                        }
+                }
+                auto vs = std::find(args.begin() + a, args.end(), "--vs");
+                Options challenger = parse_options({args.begin() + a, vs});
+                Options rival = vs == args.end() ? challenger : parse_options({vs + 1, args.end()});
+                run_arena(config, challenger, rival);
+                return 0;
+        }
+        if (args.size() >= 2 && args[0] == "--serve") {
+                std::size_t a = 2;
+                unsigned limit = 0;
+                if (a < args.size() && std::isdigit((unsigned char) args[a][0])) {
+                        limit = std::stoul(args[a++]);
+                }
+                serve(args[1], limit, parse_options({args.begin() + a, args.end()}));
+                return 0;
+        }
+        if (args.size() >= 2 && args[0] == "--replay") {
+                return run_replay(args[1], parse_options({args.begin() + 2, args.end()})) ? 0 : 1;
+        }
+        bool bench = !args.empty() && args[0] == "--bench";
+        Options options = parse_options({args.begin() + bench, args.end()});
 
-        inter.run();
+        TurnWriter out(STDOUT_FILENO);
+        if (options.fast_input) {
+                FdReader reader(STDIN_FILENO);
+                if (bench) {
+                        bench_turns(reader, options);
+                } else {
+                        Interactor<FdReader>{reader, out, options}.run();
+                }
+        } else {
+                if (bench) {
+                        bench_turns(std::cin, options);
+                } else {
+                        Interactor<std::istream>{std::cin, out, options}.run();
+                }
+        }
 }